@@ -0,0 +1,58 @@
+#include <string.h>
+
+#include "audit.h"
+
+// read straight out of the packed histories, which are only 2-byte aligned
+typedef int16_t AuditFields __attribute__((vector_size(AUDIT_LANES * sizeof(int16_t)), aligned(2), may_alias));
+typedef int32_t AuditSums __attribute__((vector_size(AUDIT_LANES * sizeof(int32_t))));
+
+enum {
+    AUDIT_FIELDS = sizeof(BalanceState) / sizeof(int16_t), ///< int16 fields a packed BalanceState is made of
+    AUDIT_BLOCK_VECTORS = AUDIT_BLOCK * AUDIT_FIELDS / AUDIT_LANES
+};
+
+/* Adds up timestamps [first, first + count) of every account field by field into sums.
+ * A packed history is a plain run of int16 fields, so whole vectors of them are widened
+ * and added without picking the fields apart. */
+static void _sum_block(const BalanceState* const* histories, int account_count, lamport_time_t first, lamport_time_t count, AuditSums* sums) {
+    size_t fields = count * AUDIT_FIELDS;
+    size_t vectors = fields / AUDIT_LANES;
+
+    memset(sums, 0, AUDIT_BLOCK_VECTORS * sizeof(AuditSums));
+    for (int account = 0; account < account_count; account++) {
+        const int16_t* run = (const int16_t*)(histories[account] + first);
+        const AuditFields* v = (const AuditFields*)run;
+
+        for (size_t i = 0; i < vectors; i++) sums[i] += __builtin_convertvector(v[i], AuditSums);
+        for (size_t i = vectors * AUDIT_LANES; i < fields; i++) sums[i / AUDIT_LANES][i % AUDIT_LANES] += run[i];
+    }
+}
+
+int audit_histories(const BalanceState* const* histories, int count, lamport_time_t len, int32_t expected_total, AuditResult* result) {
+    AuditSums sums[AUDIT_BLOCK_VECTORS];
+    const int32_t* field_sums = (const int32_t*)sums;
+
+    *result = (AuditResult) { .len = len, .first_violation = len, .total = expected_total };
+    for (lamport_time_t first = 0; first < len; first += AUDIT_BLOCK) {
+        lamport_time_t block_len = (len - first < AUDIT_BLOCK) ? len - first : AUDIT_BLOCK;
+
+        _sum_block(histories, count, first, block_len, sums);
+        for (lamport_time_t t = 0; t < block_len; t++) {
+            int32_t total = field_sums[t * AUDIT_FIELDS + offsetof(BalanceState, s_balance) / sizeof(int16_t)] +
+                field_sums[t * AUDIT_FIELDS + offsetof(BalanceState, s_balance_pending_in) / sizeof(int16_t)];
+            if (total == expected_total) continue;
+            result->first_violation = first + t;
+            result->total = total;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int audit_all_history(const AllHistory* history, int32_t expected_total, AuditResult* result) {
+    const BalanceState* histories[MAX_PROCESS_ID];
+    lamport_time_t len = (history->s_history_len > 0) ? history->s_history[0].s_history_len : 0;
+
+    for (int i = 0; i < history->s_history_len; i++) histories[i] = history->s_history[i].s_history;
+    return audit_histories(histories, history->s_history_len, len, expected_total, result);
+}
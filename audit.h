@@ -0,0 +1,40 @@
+#ifndef __IFMO_DISTRIBUTED_CLASS_AUDIT__H
+#define __IFMO_DISTRIBUTED_CLASS_AUDIT__H
+
+#include <stdint.h>
+
+#include "banking.h"
+#include "lamport.h"
+
+/*
+ * Conservation check over finished histories: the balance plus pending-in of every
+ * account, summed at each Lamport time, must stay at the initial total.
+ *
+ * A packed BalanceState array is read as a plain run of int16 fields. A block of
+ * timestamps is summed across accounts field by field, AUDIT_LANES fields widened to
+ * int32 and added per vector operation, s_time included since nothing is picked apart.
+ * The balance and pending-in sums of each timestamp are then read out of the block and
+ * the sums of s_time are ignored. A block of sums stays in L1 however long the histories are.
+ */
+
+enum {
+    AUDIT_LANES = 8,    ///< int16 fields widened and added at a time, a 16-byte vector on SSE2 and NEON
+    AUDIT_BLOCK = 1024  ///< timestamps summed at a time, a multiple of AUDIT_LANES
+};
+
+typedef struct {
+    lamport_time_t len;             ///< timestamps checked
+    lamport_time_t first_violation; ///< first time the total is off, len if there is none
+    int32_t total;                  ///< total at first_violation, the expected one if there is none
+} AuditResult;
+
+/** Checks count histories of len entries each, histories[i] being the states of one account.
+ *
+ * @return 0 if the total stays expected_total at every time, 1 otherwise
+ */
+int audit_histories(const BalanceState* const* histories, int count, lamport_time_t len, int32_t expected_total, AuditResult* result);
+
+/** Same as audit_histories() for an AllHistory aligned to one length, as print_history() gets it */
+int audit_all_history(const AllHistory* history, int32_t expected_total, AuditResult* result);
+
+#endif // __IFMO_DISTRIBUTED_CLASS_AUDIT__H
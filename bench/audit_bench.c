@@ -0,0 +1,86 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "audit.h"
+
+/*
+ * Checks conservation over MAX_PROCESS_ID synthetic histories of growing length, once with the
+ * row-by-row loop the parent used to run and once with audit_histories(), and reports the time per check.
+ * The last timestamp of every history is off, so both have to scan it all.
+ */
+
+enum {
+    BENCH_ACCOUNTS = MAX_PROCESS_ID,
+    BENCH_TOTAL = BENCH_ACCOUNTS * 100,
+    BENCH_WORK = 1 << 24 ///< timestamps checked per measurement, spread over as many rounds as it takes
+};
+
+static lamport_time_t rowwise_first_violation(const BalanceState* const* histories, int count, lamport_time_t len, int32_t expected_total) {
+    for (lamport_time_t t = 0; t < len; t++) {
+        int32_t total = 0;
+        for (int i = 0; i < count; i++) total += histories[i][t].s_balance + histories[i][t].s_balance_pending_in;
+        if (total != expected_total) return t;
+    }
+    return len;
+}
+
+static double elapsed_ns(const struct timespec* from, const struct timespec* to) {
+    return (to->tv_sec - from->tv_sec) * 1e9 + (to->tv_nsec - from->tv_nsec);
+}
+
+int main(void) {
+    static const lamport_time_t lengths[] = { MAX_T, 4096, 65536, 1 << 20 };
+    BalanceState* histories[BENCH_ACCOUNTS];
+    struct timespec from, to;
+
+    srand(1);
+    printf("%10s | %14s | %14s | %8s\n", "timestamps", "row-wise ns", "columnar ns", "speedup");
+
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+        lamport_time_t len = lengths[l];
+        int rounds = BENCH_WORK / len;
+
+        for (int i = 0; i < BENCH_ACCOUNTS; i++) {
+            histories[i] = malloc(len * sizeof(BalanceState));
+            if (histories[i] == NULL) {
+                fprintf(stderr, "Failed to allocate %u timestamps\n", len);
+                return 1;
+            }
+        }
+        // money moves between random accounts and spends a while pending, the total stays put
+        for (lamport_time_t t = 0; t < len; t++) {
+            int32_t rest = BENCH_TOTAL;
+            for (int i = 0; i < BENCH_ACCOUNTS; i++) {
+                balance_t pending = (i + 1 < BENCH_ACCOUNTS) ? rand() % 10 : 0;
+                balance_t balance = (i + 1 < BENCH_ACCOUNTS) ? 90 + rand() % 20 - pending : rest;
+                histories[i][t] = (BalanceState) { .s_balance = balance, .s_time = t, .s_balance_pending_in = pending };
+                rest -= balance + pending;
+            }
+        }
+        histories[0][len - 1].s_balance++;
+
+        const BalanceState* const* checked = (const BalanceState* const*)histories;
+        lamport_time_t rowwise = 0;
+        clock_gettime(CLOCK_MONOTONIC, &from);
+        for (int round = 0; round < rounds; round++) rowwise = rowwise_first_violation(checked, BENCH_ACCOUNTS, len, BENCH_TOTAL);
+        clock_gettime(CLOCK_MONOTONIC, &to);
+        double rowwise_ns = elapsed_ns(&from, &to) / rounds;
+
+        AuditResult audit;
+        clock_gettime(CLOCK_MONOTONIC, &from);
+        for (int round = 0; round < rounds; round++) audit_histories(checked, BENCH_ACCOUNTS, len, BENCH_TOTAL, &audit);
+        clock_gettime(CLOCK_MONOTONIC, &to);
+        double columnar_ns = elapsed_ns(&from, &to) / rounds;
+
+        if (rowwise != len - 1 || audit.first_violation != len - 1) {
+            fprintf(stderr, "Violation found at %u and %u instead of %u\n", rowwise, audit.first_violation, len - 1);
+            return 1;
+        }
+
+        printf("%10u | %14.0f | %14.0f | %7.1fx\n", len, rowwise_ns, columnar_ns, rowwise_ns / columnar_ns);
+        for (int i = 0; i < BENCH_ACCOUNTS; i++) free(histories[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,5 @@
+#!/bin/bash
+cd "$(dirname "$0")"
+clang -std=c99 -Wall -pedantic -O2 -I.. ../history.c ../audit.c pending_bench.c -o pending_bench
+clang -std=c99 -Wall -pedantic -O2 -I.. ../audit.c audit_bench.c -o audit_bench
+clang -std=c99 -Wall -pedantic -O2 -I.. ../ipc.c ../worker.c ../ring.c ../logger.c ../unixsock.c ../stats.c ../lamport.c ../trace.c ipc_bench.c -o ipc_bench
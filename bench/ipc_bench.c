@@ -0,0 +1,246 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "worker.h"
+
+/*
+ * Measures the ipc.c primitives outside of the bank scenario:
+ *  - ping-pong round trips between the parent and one child,
+ *  - one-way streaming from a child to the parent at several payload sizes,
+ *  - receive_any() in the parent while a growing number of children send to it.
+ *
+ * usage: ipc_bench [--transport pipe|shm] [--topology mesh|lazy] [--messages N]
+ */
+
+enum {
+    BENCH_DEFAULT_MESSAGES = 100000,
+    BENCH_STOP = -1 ///< payload size that ends a streaming child
+};
+
+typedef struct {
+    Transport transport;
+    Topology topology;
+    int messages; // per measurement
+} BenchConfig;
+
+typedef int (*BenchRole)(Worker* s, const BenchConfig* cfg);
+
+static const size_t stream_sizes[] = { 0, 64, 512, MAX_PAYLOAD_LEN };
+
+static const worker_id fan_in_senders[] = { 1, 2, 4, 8, MAX_PROCESS_ID };
+
+static Message bench_msg;
+
+static int64_t _now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int _compare_ns(const void* a, const void* b) {
+    int64_t lhs = *(const int64_t*)a, rhs = *(const int64_t*)b;
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+static int _send_sized(Worker* s, local_id dst, int payload_len) {
+    bench_msg.s_header = (MessageHeader) { .s_magic = MESSAGE_MAGIC, .s_type = TRANSFER, .s_payload_len = payload_len };
+    return send_iov(s, dst, &bench_msg.s_header, bench_msg.s_payload);
+}
+
+/* Sends the payload size to stream as a tiny control message */
+static int _send_control(Worker* s, local_id dst, int value) {
+    MessageHeader header = { .s_magic = MESSAGE_MAGIC, .s_type = STARTED, .s_payload_len = sizeof(value) };
+    return send_iov(s, dst, &header, &value);
+}
+
+static int _child_pong(Worker* s, const BenchConfig* cfg) {
+    for (int i = 0; i < cfg->messages; i++) {
+        if (receive(s, PARENT_ID, &bench_msg) != 0) return 1;
+        if (send(s, PARENT_ID, &bench_msg) != 0) return 1;
+    }
+    return 0;
+}
+
+static int _parent_ping(Worker* s, const BenchConfig* cfg) {
+    int64_t* rtt_ns = malloc(cfg->messages * sizeof(int64_t));
+    if (rtt_ns == NULL) return 1;
+
+    for (int i = 0; i < cfg->messages; i++) {
+        int64_t started = _now_ns();
+        if (_send_sized(s, 1, 0) != 0 || receive(s, 1, &bench_msg) != 0) {
+            free(rtt_ns);
+            return 1;
+        }
+        rtt_ns[i] = _now_ns() - started;
+    }
+    qsort(rtt_ns, cfg->messages, sizeof(int64_t), _compare_ns);
+
+    printf("ping-pong round trip, ns: p50 %lld  p90 %lld  p99 %lld  p99.9 %lld  max %lld\n",
+        (long long)rtt_ns[cfg->messages / 2], (long long)rtt_ns[cfg->messages * 9 / 10], (long long)rtt_ns[cfg->messages * 99 / 100],
+        (long long)rtt_ns[cfg->messages * 999 / 1000], (long long)rtt_ns[cfg->messages - 1]);
+    free(rtt_ns);
+    return 0;
+}
+
+static int _child_stream(Worker* s, const BenchConfig* cfg) {
+    while (1) {
+        int payload_len;
+        if (receive(s, PARENT_ID, &bench_msg) != 0) return 1;
+        memcpy(&payload_len, bench_msg.s_payload, sizeof(payload_len));
+        if (payload_len == BENCH_STOP) return 0;
+
+        for (int i = 0; i < cfg->messages; i++) {
+            if (_send_sized(s, PARENT_ID, payload_len) != 0) return 1;
+        }
+    }
+}
+
+static int _parent_stream(Worker* s, const BenchConfig* cfg) {
+    printf("%12s | %12s | %10s\n", "payload B", "msgs/s", "MB/s");
+    for (size_t i = 0; i < sizeof(stream_sizes) / sizeof(stream_sizes[0]); i++) {
+        int64_t started = _now_ns();
+        if (_send_control(s, 1, stream_sizes[i]) != 0) return 1;
+        for (int m = 0; m < cfg->messages; m++) {
+            if (receive(s, 1, &bench_msg) != 0) return 1;
+        }
+        double seconds = (_now_ns() - started) / 1e9;
+        double bytes = (double)cfg->messages * (sizeof(MessageHeader) + stream_sizes[i]);
+        printf("%12zu | %12.0f | %10.1f\n", stream_sizes[i], cfg->messages / seconds, bytes / seconds / 1e6);
+    }
+    return _send_control(s, 1, BENCH_STOP);
+}
+
+static int _child_fan_in(Worker* s, const BenchConfig* cfg) {
+    int count = cfg->messages / s->nbr_count;
+    if (receive(s, PARENT_ID, &bench_msg) != 0) return 1;
+    for (int i = 0; i < count; i++) {
+        if (_send_sized(s, PARENT_ID, 0) != 0) return 1;
+    }
+    return 0;
+}
+
+static int _parent_fan_in(Worker* s, const BenchConfig* cfg) {
+    int total = cfg->messages / s->nbr_count * s->nbr_count;
+
+    int64_t started = _now_ns();
+    for (local_id child = PARENT_ID + 1; child < s->nbr_count + 1; child++) {
+        if (_send_control(s, child, 0) != 0) return 1;
+    }
+    for (int m = 0; m < total; m++) {
+        if (receive_any(s, &bench_msg) != 0) return 1;
+    }
+    double ns = (double)(_now_ns() - started);
+    printf("%12d | %12.0f | %12.0f\n", s->nbr_count, ns / total, total / ns * 1e9);
+    return 0;
+}
+
+/* Forks nbr_count children running child_role against the parent running parent_role */
+static int run_phase(const BenchConfig* cfg, worker_id nbr_count, BenchRole child_role, BenchRole parent_role, Logger* log) {
+    int result = 0;
+    Worker* workers = calloc(nbr_count + 1, sizeof(Worker));
+    if (workers == NULL) return 1;
+
+    if (init_workers(workers, nbr_count, cfg->transport, cfg->topology, log, log) != 0) {
+        free(workers);
+        return 1;
+    }
+    logger_flush(log);
+    fflush(stdout);
+
+    for (worker_id id = PARENT_ID + 1; id < nbr_count + 1; id++) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            fprintf(stderr, "Failed to fork bench worker %d: %s\n", id, strerror(errno));
+            result = 1;
+            nbr_count = id - 1;
+            break;
+        }
+        if (pid == 0) {
+            Worker* w = &workers[id];
+            int status = (deinit_unused_channels(w, workers, log) != 0) ? 1 : child_role(w, cfg);
+            deinit_workers(w, workers, log);
+            exit(status);
+        }
+    }
+
+    Worker* w = &workers[PARENT_ID];
+    if (result == 0 && deinit_unused_channels(w, workers, log) != 0) result = 1;
+    if (result == 0) result = parent_role(w, cfg);
+
+    // a failed parent leaves children blocked in receive, closing our ends lets them see EOF
+    deinit_workers(w, workers, log);
+    int status;
+    while (wait(&status) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) result = 1;
+    }
+    return result;
+}
+
+int main(int argc, char** argv) {
+    BenchConfig cfg = { .transport = TRANSPORT_PIPE, .topology = TOPOLOGY_MESH, .messages = BENCH_DEFAULT_MESSAGES };
+
+    for (int opt = 1; opt < argc; opt++) {
+        if (strcmp(argv[opt], "--transport") == 0 && opt + 1 < argc) {
+            opt++;
+            if (strcmp(argv[opt], "pipe") == 0) {
+                cfg.transport = TRANSPORT_PIPE;
+            } else if (strcmp(argv[opt], "shm") == 0) {
+                cfg.transport = TRANSPORT_SHM;
+            } else {
+                fprintf(stderr, "error: Unknown transport %s\n", argv[opt]);
+                return 1;
+            }
+        } else if (strcmp(argv[opt], "--topology") == 0 && opt + 1 < argc) {
+            opt++;
+            if (strcmp(argv[opt], "mesh") == 0) {
+                cfg.topology = TOPOLOGY_MESH;
+            } else if (strcmp(argv[opt], "lazy") == 0) {
+                cfg.topology = TOPOLOGY_LAZY;
+            } else {
+                fprintf(stderr, "error: Unknown topology %s\n", argv[opt]);
+                return 1;
+            }
+        } else if (strcmp(argv[opt], "--messages") == 0 && opt + 1 < argc) {
+            cfg.messages = atoi(argv[++opt]);
+            if (cfg.messages < MAX_PROCESS_ID) {
+                fprintf(stderr, "error: Message count must be at least %d\n", MAX_PROCESS_ID);
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "usage: %s [--transport pipe|shm] [--topology mesh|lazy] [--messages N]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (cfg.topology == TOPOLOGY_LAZY && cfg.transport != TRANSPORT_PIPE) {
+        fprintf(stderr, "error: Lazy topology needs the pipe transport\n");
+        return 1;
+    }
+
+    // channel set-up chatter is of no interest here
+    Logger* log = logger_open("/dev/null");
+    if (log == NULL) {
+        fprintf(stderr, "Failed to open /dev/null: %s\n", strerror(errno));
+        return 1;
+    }
+
+    printf("transport %s, topology %s, %d messages per measurement\n\n", (cfg.transport == TRANSPORT_SHM) ? "shm" : "pipe",
+        (cfg.topology == TOPOLOGY_LAZY) ? "lazy" : "mesh", cfg.messages);
+
+    if (run_phase(&cfg, 1, _child_pong, _parent_ping, log) != 0) return 1;
+    printf("\n");
+    if (run_phase(&cfg, 1, _child_stream, _parent_stream, log) != 0) return 1;
+
+    printf("\n%12s | %12s | %12s\n", "senders", "ns/msg", "msgs/s");
+    for (size_t i = 0; i < sizeof(fan_in_senders) / sizeof(fan_in_senders[0]); i++) {
+        if (run_phase(&cfg, fan_in_senders[i], _child_fan_in, _parent_fan_in, log) != 0) return 1;
+    }
+
+    logger_close(log);
+    return 0;
+}
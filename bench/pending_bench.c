@@ -0,0 +1,140 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "history.h"
+
+/*
+ * Fills one account's balance history from a synthetic stream of incoming transfers, once by rescanning
+ * every received transfer per timestamp and once with AccountHistory, and reports the time per history.
+ */
+
+enum {
+    BENCH_LAST_TIME = MAX_T - 1, ///< every transfer is received at or before this time
+    BENCH_MAX_DELAY = 8,         ///< Lamport ticks a transfer spends in the channel at most
+    BENCH_ROUNDS = 200
+};
+
+typedef struct {
+    timestamp_t sent_at;
+    timestamp_t received_at;
+    balance_t amount;
+} Transfer;
+
+typedef struct {
+    BalanceHistory history;
+    Transfer* received;
+    int received_count;
+} RescanHistory;
+
+static balance_t rescan_pending_at(const RescanHistory* h, timestamp_t t) {
+    balance_t pending = 0;
+    for (int i = 0; i < h->received_count; i++) {
+        if (h->received[i].sent_at <= t && t < h->received[i].received_at) pending += h->received[i].amount;
+    }
+    return pending;
+}
+
+static void rescan_record(RescanHistory* h, timestamp_t to_time, balance_t balance) {
+    balance_t base_balance = h->history.s_history[h->history.s_history_len - 1].s_balance;
+    for (timestamp_t t = h->history.s_history_len; t <= to_time; t++) {
+        h->history.s_history[t].s_time = t;
+        h->history.s_history[t].s_balance = (t < to_time) ? base_balance : balance;
+        h->history.s_history[t].s_balance_pending_in = rescan_pending_at(h, t);
+    }
+    h->history.s_history_len = to_time + 1;
+}
+
+static void rescan_run(RescanHistory* h, const Transfer* transfers, int count) {
+    balance_t balance = 0;
+
+    h->received_count = 0;
+    h->history.s_history_len = 1;
+    h->history.s_history[0] = (BalanceState) { .s_balance = balance, .s_time = 0, .s_balance_pending_in = 0 };
+
+    for (int i = 0; i < count; i++) {
+        h->received[h->received_count++] = transfers[i];
+        for (timestamp_t t = transfers[i].sent_at; t < h->history.s_history_len; t++) {
+            h->history.s_history[t].s_balance_pending_in += transfers[i].amount;
+        }
+        balance += transfers[i].amount;
+        // transfers received at the same time arrive in one frame
+        if (i + 1 == count || transfers[i + 1].received_at != transfers[i].received_at) {
+            rescan_record(h, transfers[i].received_at, balance);
+        }
+    }
+}
+
+static void incremental_run(AccountHistory* h, const Transfer* transfers, int count) {
+    balance_t balance = 0;
+
+    account_history_free(h);
+    account_history_init(h, 1, balance, MAX_T);
+
+    for (int i = 0; i < count; i++) {
+        account_history_add_pending(h, transfers[i].sent_at, transfers[i].received_at, transfers[i].amount);
+        balance += transfers[i].amount;
+        if (i + 1 == count || transfers[i + 1].received_at != transfers[i].received_at) {
+            account_history_record(h, transfers[i].received_at, balance);
+        }
+    }
+}
+
+static int compare_received_at(const void* a, const void* b) {
+    return ((const Transfer*)a)->received_at - ((const Transfer*)b)->received_at;
+}
+
+static double elapsed_ns(const struct timespec* from, const struct timespec* to) {
+    return (to->tv_sec - from->tv_sec) * 1e9 + (to->tv_nsec - from->tv_nsec);
+}
+
+int main(void) {
+    static const int transfer_counts[] = { 16, 64, 256, 1024, 4096, 16384 };
+    static RescanHistory rescan;
+    static AccountHistory incremental;
+    struct timespec from, to;
+
+    srand(1);
+    printf("%10s | %14s | %14s | %8s\n", "transfers", "rescan ns", "incremental ns", "speedup");
+
+    for (size_t c = 0; c < sizeof(transfer_counts) / sizeof(transfer_counts[0]); c++) {
+        int count = transfer_counts[c];
+        Transfer* transfers = malloc(count * sizeof(Transfer));
+        rescan.received = malloc(count * sizeof(Transfer));
+        if (transfers == NULL || rescan.received == NULL) {
+            fprintf(stderr, "Failed to allocate %d transfers\n", count);
+            return 1;
+        }
+
+        for (int i = 0; i < count; i++) {
+            transfers[i].received_at = 1 + rand() % BENCH_LAST_TIME;
+            transfers[i].sent_at = transfers[i].received_at - 1 - rand() % BENCH_MAX_DELAY;
+            if (transfers[i].sent_at < 0) transfers[i].sent_at = 0;
+            transfers[i].amount = 1;
+        }
+        qsort(transfers, count, sizeof(Transfer), compare_received_at);
+
+        clock_gettime(CLOCK_MONOTONIC, &from);
+        for (int round = 0; round < BENCH_ROUNDS; round++) rescan_run(&rescan, transfers, count);
+        clock_gettime(CLOCK_MONOTONIC, &to);
+        double rescan_ns = elapsed_ns(&from, &to) / BENCH_ROUNDS;
+
+        clock_gettime(CLOCK_MONOTONIC, &from);
+        for (int round = 0; round < BENCH_ROUNDS; round++) incremental_run(&incremental, transfers, count);
+        clock_gettime(CLOCK_MONOTONIC, &to);
+        double incremental_ns = elapsed_ns(&from, &to) / BENCH_ROUNDS;
+
+        size_t history_size = rescan.history.s_history_len * sizeof(BalanceState);
+        if (incremental.len != rescan.history.s_history_len || memcmp(incremental.states, rescan.history.s_history, history_size) != 0) {
+            fprintf(stderr, "Histories differ for %d transfers\n", count);
+            return 1;
+        }
+
+        printf("%10d | %14.0f | %14.0f | %7.1fx\n", count, rescan_ns, incremental_ns, rescan_ns / incremental_ns);
+        free(transfers);
+        free(rescan.received);
+    }
+    return 0;
+}
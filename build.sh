@@ -1,2 +1,3 @@
 #!/bin/bash
-clang -std=c99 -Wall -pedantic -Llib64 -lruntime *.c -o pa2
+# -rdynamic lets --scenario objects call transfer() of the binary
+clang -std=c99 -Wall -pedantic -pthread -rdynamic -Llib64 -lruntime -ldl *.c -o pa2
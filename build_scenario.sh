@@ -0,0 +1,3 @@
+#!/bin/bash
+# builds a bank_robbery() scenario for pa2 --scenario: ./build_scenario.sh scenario.c scenario.so
+clang -std=c99 -Wall -pedantic -fPIC -shared -I"$(dirname "$0")" "$1" -o "$2"
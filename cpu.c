@@ -0,0 +1,35 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+
+#include "cpu.h"
+
+int cpu_plan(int* plan, int count) {
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE];
+    int cpu_count = 0;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return -1;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) cpus[cpu_count++] = cpu;
+    }
+    if (cpu_count == 0) {
+        errno = ESRCH;
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) plan[i] = cpus[i % cpu_count];
+    return (count < cpu_count) ? count : cpu_count;
+}
+
+int cpu_pin(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    // pid 0 is the calling thread, which is what --threads needs as well
+    return sched_setaffinity(0, sizeof(set), &set);
+}
+
+int cpu_current(void) {
+    return sched_getcpu();
+}
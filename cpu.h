@@ -0,0 +1,25 @@
+#ifndef __IFMO_DISTRIBUTED_CLASS_CPU__H
+#define __IFMO_DISTRIBUTED_CLASS_CPU__H
+
+/*
+ * CPU placement behind --pin. The plan is made once, before anything is
+ * pinned, from the CPUs the run was allowed to use; every process or thread
+ * then pins itself to its own entry.
+ */
+
+/** Spreads count processes round-robin over the CPUs the caller may run on, plan[i] is the CPU of process i.
+ *
+ * @return number of distinct CPUs used, -1 with errno set on failure
+ */
+int cpu_plan(int* plan, int count);
+
+/** Binds the calling thread to cpu and moves it there.
+ *
+ * @return 0 on success, -1 with errno set on failure
+ */
+int cpu_pin(int cpu);
+
+/** @return CPU the calling thread runs on right now, -1 if unknown */
+int cpu_current(void);
+
+#endif // __IFMO_DISTRIBUTED_CLASS_CPU__H
@@ -0,0 +1,113 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "eventlog.h"
+#include "pa2345.h"
+
+int event_format(const EventRecord* record, char* buf, size_t size) {
+    int len = 0;
+
+    switch (record->s_type) {
+    case (EVENT_STARTED): {
+        len = snprintf(buf, size, log_started_fmt, record->s_time, record->s_process, record->s_pid, record->s_parent_pid, record->s_amount);
+    } break;
+    case (EVENT_RECEIVED_ALL_STARTED): {
+        len = snprintf(buf, size, log_received_all_started_fmt, record->s_time, record->s_process);
+    } break;
+    case (EVENT_DONE): {
+        len = snprintf(buf, size, log_done_fmt, record->s_time, record->s_process, record->s_amount);
+    } break;
+    case (EVENT_TRANSFER_OUT): {
+        len = snprintf(buf, size, log_transfer_out_fmt, record->s_time, record->s_process, record->s_amount, record->s_peer);
+    } break;
+    case (EVENT_TRANSFER_IN): {
+        len = snprintf(buf, size, log_transfer_in_fmt, record->s_time, record->s_process, record->s_amount, record->s_peer);
+    } break;
+    case (EVENT_RECEIVED_ALL_DONE): {
+        len = snprintf(buf, size, log_received_all_done_fmt, record->s_time, record->s_process);
+    } break;
+    default: {
+        len = snprintf(buf, size, "unknown event type %d\n", record->s_type);
+    } break;
+    }
+
+    if (len < 0) return 0;
+    return ((size_t)len >= size) ? (int)size - 1 : len;
+}
+
+BinaryEventLog* event_log_open(const char* path) {
+    EventLogHeader existing = { 0 };
+    struct stat st;
+
+    BinaryEventLog* log = malloc(sizeof(BinaryEventLog));
+    if (log == NULL) return NULL;
+
+    log->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (log->fd == -1) goto fail;
+    if (fstat(log->fd, &st) == -1) goto fail_close;
+
+    // keep appending to a log left by an earlier run, anything else is overwritten
+    if ((size_t)st.st_size >= sizeof(existing) && pread(log->fd, &existing, sizeof(existing), 0) == sizeof(existing)
+        && (existing.magic != EVENT_LOG_MAGIC || existing.version != EVENT_LOG_VERSION || existing.record_len != sizeof(EventRecord))) {
+        existing.count = 0;
+    }
+    if (existing.count > existing.capacity) existing.count = existing.capacity;
+
+    uint64_t capacity = existing.count + EVENT_LOG_CAPACITY;
+    log->map_len = EVENT_LOG_HEADER_LEN + capacity * sizeof(EventRecord);
+    if (ftruncate(log->fd, log->map_len) == -1) goto fail_close;
+
+    void* map = mmap(NULL, log->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, log->fd, 0);
+    if (map == MAP_FAILED) goto fail_close;
+
+    log->owner = getpid();
+    log->header = map;
+    log->records = (EventRecord*)((char*)map + EVENT_LOG_HEADER_LEN);
+    *log->header = (EventLogHeader) {
+        .magic = EVENT_LOG_MAGIC,
+        .version = EVENT_LOG_VERSION,
+        .record_len = sizeof(EventRecord),
+        .capacity = capacity,
+        .count = existing.count,
+    };
+    return log;
+
+fail_close:
+    close(log->fd);
+fail:
+    free(log);
+    return NULL;
+}
+
+int event_log_append(BinaryEventLog* log, const EventRecord* record) {
+    uint64_t slot = __atomic_fetch_add(&log->header->count, 1, __ATOMIC_RELAXED);
+    if (slot >= log->header->capacity) return -1;
+    log->records[slot] = *record;
+    return 0;
+}
+
+void event_log_close(BinaryEventLog* log) {
+    if (log->owner == getpid()) {
+        uint64_t count = __atomic_load_n(&log->header->count, __ATOMIC_RELAXED);
+        if (count > log->header->capacity) {
+            count = log->header->capacity;
+            log->header->count = count;
+        }
+        log->header->capacity = count;
+        munmap(log->header, log->map_len);
+        if (ftruncate(log->fd, EVENT_LOG_HEADER_LEN + count * sizeof(EventRecord)) == -1) {
+            fprintf(stderr, "Failed to trim the binary event log: %s\n", strerror(errno));
+        }
+    } else {
+        munmap(log->header, log->map_len);
+    }
+    close(log->fd);
+    free(log);
+}
@@ -0,0 +1,85 @@
+#ifndef __IFMO_DISTRIBUTED_CLASS_EVENTLOG__H
+#define __IFMO_DISTRIBUTED_CLASS_EVENTLOG__H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "banking.h"
+
+static const char* const events_bin_log = "events.bin";
+
+typedef enum {
+    EVENT_LOG_TEXT = 0, // printf lines in events.log
+    EVENT_LOG_BINARY,   // EventRecords in events.bin, rendered to text offline
+} EventLogFormat;
+
+typedef enum {
+    EVENT_STARTED = 1,          // log_started_fmt
+    EVENT_RECEIVED_ALL_STARTED, // log_received_all_started_fmt
+    EVENT_DONE,                 // log_done_fmt
+    EVENT_TRANSFER_OUT,         // log_transfer_out_fmt
+    EVENT_TRANSFER_IN,          // log_transfer_in_fmt
+    EVENT_RECEIVED_ALL_DONE,    // log_received_all_done_fmt
+} EventType;
+
+/**
+ * One events.log line as a fixed-size record. Fields a line type does not print stay 0.
+ */
+typedef struct {
+    int32_t s_time;
+    int32_t s_pid;        ///< EVENT_STARTED only
+    int32_t s_parent_pid; ///< EVENT_STARTED only
+    balance_t s_amount;   ///< balance or transferred amount
+    uint8_t s_type;       ///< EventType
+    local_id s_process;
+    local_id s_peer; ///< the other side of a transfer
+    uint8_t s_reserved[3];
+} __attribute__((packed)) EventRecord;
+
+enum {
+    EVENT_LOG_MAGIC = 0x56454150,   ///< "PAEV"
+    EVENT_LOG_VERSION = 1,
+    EVENT_LOG_CAPACITY = 1 << 20,   ///< records a run can add, the file is sparse until they are written
+    EVENT_LOG_HEADER_LEN = 64       ///< records start on their own cache line
+};
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_len;
+    uint64_t capacity; ///< records the file has room for
+    uint64_t count;    ///< records reserved so far, bumped atomically by every process sharing the mapping
+} EventLogHeader;
+
+/**
+ * events.bin mapped into memory. Opened once before fork(), the mapping is shared,
+ * so every process appends by reserving the next slot in the header.
+ */
+typedef struct {
+    int fd;
+    pid_t owner; ///< the process that opened the log and truncates it on close
+    EventLogHeader* header;
+    EventRecord* records;
+    size_t map_len;
+} BinaryEventLog;
+
+/** Renders a record exactly like the matching pa2345.h format.
+ *
+ * @return the length of the line, cut to size - 1 if it does not fit
+ */
+int event_format(const EventRecord* record, char* buf, size_t size);
+
+/** Maps path, appending to the records already in it if it is a binary event log.
+ *
+ * @return the log, NULL with errno set on failure
+ */
+BinaryEventLog* event_log_open(const char* path);
+
+/** @return 0 on success, -1 if the log is full */
+int event_log_append(BinaryEventLog* log, const EventRecord* record);
+
+/** Unmaps the log, the process that opened it also cuts the file down to the records written */
+void event_log_close(BinaryEventLog* log);
+
+#endif // __IFMO_DISTRIBUTED_CLASS_EVENTLOG__H
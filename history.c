@@ -0,0 +1,142 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "audit.h"
+#include "history.h"
+
+enum {
+    HISTORY_INITIAL_CAPACITY = MAX_T + 1
+};
+
+/* Makes room for timestamps up to and including t */
+static int _reserve(AccountHistory* h, lamport_time_t t) {
+    if (t >= h->max_time) return -1;
+    if (t < h->capacity) return 0;
+
+    // doubling stops at max_time, which would wrap around past 2^31 under --long-run
+    lamport_time_t capacity = h->capacity;
+    while (capacity <= t) capacity = (capacity > h->max_time / 2) ? h->max_time : capacity * 2;
+
+    BalanceState* states = realloc(h->states, (size_t)capacity * sizeof(BalanceState));
+    if (states == NULL) return -1;
+    h->states = states;
+    balance_t* pending_delta = realloc(h->pending_delta, (size_t)capacity * sizeof(balance_t));
+    if (pending_delta == NULL) return -1;
+    h->pending_delta = pending_delta;
+
+    memset(h->pending_delta + h->capacity, 0, (size_t)(capacity - h->capacity) * sizeof(balance_t));
+    h->capacity = capacity;
+    return 0;
+}
+
+int account_history_init(AccountHistory* h, local_id id, balance_t balance, lamport_time_t max_time) {
+    *h = (AccountHistory) { .id = id, .max_time = max_time, .capacity = HISTORY_INITIAL_CAPACITY };
+
+    h->states = malloc(h->capacity * sizeof(BalanceState));
+    h->pending_delta = calloc(h->capacity, sizeof(balance_t));
+    if (h->states == NULL || h->pending_delta == NULL) {
+        account_history_free(h);
+        return -1;
+    }
+    h->states[0] = (BalanceState) { .s_balance = balance, .s_time = 0, .s_balance_pending_in = 0 };
+    h->len = 1;
+    return 0;
+}
+
+void account_history_free(AccountHistory* h) {
+    free(h->states);
+    free(h->pending_delta);
+    h->states = NULL;
+    h->pending_delta = NULL;
+    h->len = h->capacity = 0;
+}
+
+int account_history_add_pending(AccountHistory* h, lamport_time_t sent_at, lamport_time_t received_at, balance_t amount) {
+    if (_reserve(h, received_at) != 0) return -1;
+
+    if (sent_at < h->len) {
+        // with several transfers in flight our history may already cover part of the time this one spent in the channel
+        for (lamport_time_t t = sent_at; t < h->len; t++) {
+            h->states[t].s_balance_pending_in += amount;
+        }
+        h->pending_in += amount;
+    } else {
+        h->pending_delta[sent_at] += amount;
+    }
+    h->pending_delta[received_at] -= amount;
+    return 0;
+}
+
+int account_history_record(AccountHistory* h, lamport_time_t to_time, balance_t balance) {
+    if (_reserve(h, to_time) != 0) return -1;
+
+    balance_t base_balance = h->states[h->len - 1].s_balance;
+    for (lamport_time_t t = h->len; t <= to_time; t++) {
+        h->pending_in += h->pending_delta[t];
+        h->states[t].s_time = t;
+        h->states[t].s_balance = (t < to_time) ? base_balance : balance;
+        h->states[t].s_balance_pending_in = h->pending_in;
+    }
+    if (to_time >= h->len) h->len = to_time + 1;
+    return 0;
+}
+
+void account_history_export(const AccountHistory* h, BalanceHistory* out) {
+    out->s_id = h->id;
+    out->s_history_len = h->len;
+    memcpy(out->s_history, h->states, h->len * sizeof(BalanceState));
+}
+
+size_t account_history_chunk(const AccountHistory* h, lamport_time_t first_time, HistoryChunk* chunk) {
+    lamport_time_t count = h->len - first_time;
+    if (count > HISTORY_CHUNK_ENTRIES) count = HISTORY_CHUNK_ENTRIES;
+
+    chunk->s_first_time = first_time;
+    chunk->s_history_len = h->len;
+    for (lamport_time_t i = 0; i < count; i++) {
+        chunk->s_entries[i].s_balance = h->states[first_time + i].s_balance;
+        chunk->s_entries[i].s_balance_pending_in = h->states[first_time + i].s_balance_pending_in;
+    }
+    return sizeof(HistoryChunk) + count * sizeof(HistoryEntry);
+}
+
+int account_history_merge_chunk(AccountHistory* h, const HistoryChunk* chunk, size_t payload_len) {
+    lamport_time_t count = (payload_len - sizeof(HistoryChunk)) / sizeof(HistoryEntry);
+
+    // the receiver starts from the initial balance at time 0, which the first chunk repeats
+    if (chunk->s_first_time > h->len || count == 0) return -1;
+    if (_reserve(h, chunk->s_first_time + count - 1) != 0) return -1;
+
+    for (lamport_time_t i = 0; i < count; i++) {
+        lamport_time_t t = chunk->s_first_time + i;
+        h->states[t] = (BalanceState) { .s_balance = chunk->s_entries[i].s_balance, .s_time = t, .s_balance_pending_in = chunk->s_entries[i].s_balance_pending_in };
+    }
+    h->len = chunk->s_first_time + count;
+    return 0;
+}
+
+int account_history_apply(AccountHistory* h, const HistoryDelta* delta) {
+    if (delta->s_sent_at == HISTORY_DELTA_BALANCE) return account_history_record(h, delta->s_time, delta->s_value);
+    return account_history_add_pending(h, delta->s_sent_at, delta->s_time, delta->s_value);
+}
+
+int account_histories_print(const AccountHistory* histories, int count, FILE* out) {
+    const BalanceState* states[MAX_PROCESS_ID];
+    lamport_time_t len = (count > 0) ? histories[0].len : 0;
+    int32_t initial_total = 0;
+    AuditResult audit;
+
+    fprintf(out, "Balance history of %d accounts over %u Lamport times\n", count, len);
+    for (int i = 0; i < count; i++) {
+        states[i] = histories[i].states;
+        initial_total += histories[i].states[0].s_balance;
+        fprintf(out, "%2d | $%d\n", histories[i].id, histories[i].states[len - 1].s_balance);
+    }
+
+    if (audit_histories(states, count, len, initial_total, &audit) != 0) {
+        fprintf(out, "Total balance changed at t=%u: $%d instead of $%d\n", audit.first_violation, audit.total, initial_total);
+        return -1;
+    }
+    fprintf(out, "Total $%d at every time\n", initial_total);
+    return 0;
+}
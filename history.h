@@ -0,0 +1,115 @@
+#ifndef __IFMO_DISTRIBUTED_CLASS_HISTORY__H
+#define __IFMO_DISTRIBUTED_CLASS_HISTORY__H
+
+#include <stdio.h>
+
+#include "banking.h"
+#include "lamport.h"
+
+/**
+ * Balance history of one account, filled in Lamport time order. The entry of time t is
+ * states[t], so BalanceState.s_time only keeps the lower 16 bits once histories outgrow
+ * timestamp_t. Money in flight towards the account is kept as a difference array over
+ * time, so filling a timestamp costs O(1) however many transfers the account has received.
+ */
+typedef struct {
+    local_id id;
+    BalanceState* states;
+    balance_t* pending_delta; ///< change of the pending amount at each timestamp not filled yet
+    lamport_time_t len;       ///< timestamps filled so far
+    lamport_time_t capacity;  ///< entries allocated in states and pending_delta
+    lamport_time_t max_time;  ///< first timestamp that may not be filled
+    balance_t pending_in;     ///< pending amount at the last filled timestamp
+} AccountHistory;
+
+/** Entry of a HistoryChunk, the time is implied by its position */
+typedef struct {
+    balance_t s_balance;
+    balance_t s_balance_pending_in;
+} __attribute__((packed)) HistoryEntry;
+
+/**
+ * BALANCE_HISTORY payload of a --long-run history, which is sent as a series of
+ * chunks since it does not fit into one frame.
+ */
+typedef struct {
+    uint32_t s_first_time;  ///< Lamport time of s_entries[0]
+    uint32_t s_history_len; ///< length of the whole history, the chunk reaching it is the last one
+    HistoryEntry s_entries[];
+} __attribute__((packed)) HistoryChunk;
+
+/**
+ * One change to a history under --stream-history. Rather than the states of every
+ * timestamp, an account streams the calls that built its history, so the parent
+ * can replay them on a copy of its own.
+ */
+typedef struct {
+    uint32_t s_time;    ///< time a balance was recorded at, or an incoming transfer was received at
+    uint32_t s_sent_at; ///< HISTORY_DELTA_BALANCE for a balance, otherwise the time the transfer left its source
+    balance_t s_value;  ///< the balance or the amount transferred
+} __attribute__((packed)) HistoryDelta;
+
+/** BALANCE_HISTORY payload under --stream-history */
+typedef struct {
+    uint8_t s_last; ///< the account is DONE and its history complete
+    HistoryDelta s_deltas[];
+} __attribute__((packed)) HistoryDeltaFrame;
+
+enum {
+    HISTORY_CHUNK_ENTRIES = (MAX_PAYLOAD_LEN - sizeof(HistoryChunk)) / sizeof(HistoryEntry), ///< entries that fit into one frame
+    HISTORY_DELTA_ENTRIES = (MAX_PAYLOAD_LEN - sizeof(HistoryDeltaFrame)) / sizeof(HistoryDelta) ///< deltas that fit into one frame
+};
+
+#define HISTORY_DELTA_BALANCE UINT32_MAX
+
+/** Starts a history holding balance at time 0. Timestamps from max_time on are rejected,
+ *  MAX_T keeps the history small enough to be sent as a BalanceHistory.
+ *
+ * @return 0 on success, -1 if the storage could not be allocated
+ */
+int account_history_init(AccountHistory* h, local_id id, balance_t balance, lamport_time_t max_time);
+
+void account_history_free(AccountHistory* h);
+
+/** Accounts for amount that left its source at sent_at and arrives at received_at.
+ *  Timestamps already filled since sent_at are corrected in place, received_at must not be filled yet.
+ *
+ * @return 0 on success, -1 if received_at is past max_time or the storage could not grow
+ */
+int account_history_add_pending(AccountHistory* h, lamport_time_t sent_at, lamport_time_t received_at, balance_t amount);
+
+/** Repeats the last balance up to to_time - 1 and records balance at to_time.
+ *
+ * @return 0 on success, -1 if to_time is past max_time or the storage could not grow
+ */
+int account_history_record(AccountHistory* h, lamport_time_t to_time, balance_t balance);
+
+/** Copies a history shorter than MAX_T into the fixed layout print_history() and the PA wire format use */
+void account_history_export(const AccountHistory* h, BalanceHistory* out);
+
+/** Encodes the entries from first_time on, as many as fit into one frame.
+ *
+ * @return payload length of the chunk
+ */
+size_t account_history_chunk(const AccountHistory* h, lamport_time_t first_time, HistoryChunk* chunk);
+
+/** Stores the entries of a chunk received from the account, chunks must arrive in order.
+ *
+ * @return 0 on success, -1 if the chunk does not continue the history or the storage could not grow
+ */
+int account_history_merge_chunk(AccountHistory* h, const HistoryChunk* chunk, size_t payload_len);
+
+/** Replays a delta with account_history_record() or account_history_add_pending().
+ *
+ * @return the result of the call
+ */
+int account_history_apply(AccountHistory* h, const HistoryDelta* delta);
+
+/** Prints the final balances of count histories aligned to the same length
+ *  and checks that their total plus pending-in stays the same at every time.
+ *
+ * @return 0 if the total is conserved, -1 otherwise
+ */
+int account_histories_print(const AccountHistory* histories, int count, FILE* out);
+
+#endif // __IFMO_DISTRIBUTED_CLASS_HISTORY__H
@@ -1,40 +1,94 @@
-#define _POSIX_C_SOURCE 199309L
+#define _POSIX_C_SOURCE 200809L
 #include "ipc.h"
+#include "lamport.h"
+#include "stats.h"
 #include "worker.h"
 #include <assert.h>
 #include <errno.h>
+#include <poll.h>
 #include <stddef.h>
 #include <stdio.h>
-#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-#define spin()                                                   \
-    do {                                                         \
-        struct timespec ts = { .tv_sec = 0, .tv_nsec = 100000 }; \
-        nanosleep(&ts, NULL);                                    \
-    } while (0)
+static int _wait_fd(int fd, short events);
 
-static int _write_all(int fd, const char* buf, size_t size);
+static int _writev_all(int fd, struct iovec* iov, int iovcnt);
 
-static int _read_all(int fd, char* buf, size_t size);
+static ssize_t _fill_rx(Channel* ch);
+
+static size_t _frame_prefix_len(const Worker* s);
+
+static int _peek_frame(Worker* s, local_id from, MessageHeader* header, lamport_time_t* local_time);
+
+static int _pick_frame(Worker* s, MessageHeader* header);
+
+static void _consume_frame(Worker* s, local_id from, void* payload);
+
+static int _ring_writev_all(Worker* s, local_id dst, const struct iovec* iov, int iovcnt);
+
+static int _ring_wait(Worker* s, Doorbell* bell, uint32_t seq);
+
+static int _ring_wait_header(Worker* s, local_id from, MessageHeader* header);
+
+static int _ring_wait_any_header(Worker* s, MessageHeader* header);
+
+static int _replay_header(Worker* s, MessageHeader* header);
 
 int send(void* self, local_id dst, const Message* msg) {
+    return send_iov(self, dst, &msg->s_header, msg->s_payload);
+}
+
+int send_iov(void* self, local_id dst, const MessageHeader* header, const void* payload) {
     Worker* s = self;
-    int res;
+    struct iovec iov[3];
+    int iovcnt = 0;
+    uint16_t time_hi;
     assert((s->id != dst) && "Send to self");
-    assert((msg->s_header.s_payload_len <= MAX_PAYLOAD_LEN) && "Message payload len is bigger than MAX_PAYLOAD_LEN");
+    assert((header->s_payload_len <= MAX_PAYLOAD_LEN) && "Message payload len is bigger than MAX_PAYLOAD_LEN");
 
-    res = _write_all(s->chs[dst].write_fd, (const char*)msg, sizeof(msg->s_header) + msg->s_header.s_payload_len);
-    if (res != 0) return res;
+    // headers are stamped with the time of the send or shortly before, so the clock tells the upper half
+    lamport_time_t time = lamport_widen(header->s_local_time, get_lamport_time_wide());
+    if (s->replay != NULL) {
+        // a mismatch is only counted, so the replay goes on and its report covers the whole trace
+        trace_check_sent(s->replay, dst, time, header, payload);
+        return 0;
+    }
 
-    return 0;
+    iov[iovcnt++] = (struct iovec) { .iov_base = (void*)header, .iov_len = sizeof(*header) };
+    if (s->wide_clock) {
+        time_hi = time >> 16;
+        iov[iovcnt++] = (struct iovec) { .iov_base = &time_hi, .iov_len = sizeof(time_hi) };
+    }
+    iov[iovcnt++] = (struct iovec) { .iov_base = (void*)payload, .iov_len = header->s_payload_len };
+
+    int result;
+    if (s->transport == TRANSPORT_SHM) {
+        result = _ring_writev_all(s, dst, iov, iovcnt);
+    } else if (s->chs[dst].write_fd == -1 && connect_lazy_channel(s, dst) != 0) {
+        result = -1;
+    } else {
+        result = _writev_all(s->chs[dst].write_fd, iov, iovcnt);
+    }
+    if (result == 0) {
+        stats_count_message(process_stats->sent_to, process_stats->sent_by_type, dst, header->s_type, _frame_prefix_len(s) + header->s_payload_len);
+        if (s->trace != NULL) trace_append(s->trace, TRACE_SENT, dst, time, header, payload);
+    }
+    return result;
 }
 
 int send_multicast(void* self, const Message* msg) {
+    return send_multicast_iov(self, &msg->s_header, msg->s_payload);
+}
+
+int send_multicast_iov(void* self, const MessageHeader* header, const void* payload) {
     Worker* s = self;
     for (worker_id nbr_id = 0; nbr_id < s->nbr_count + 1; nbr_id++) {
         if (nbr_id == s->id) continue;
-        int result = send(self, nbr_id, msg);
+        int result = send_iov(self, nbr_id, header, payload);
         if (result != 0) return result;
     }
     return 0;
@@ -43,82 +97,265 @@ int send_multicast(void* self, const Message* msg) {
 int receive(void* self, local_id from, Message* msg) {
     Worker* s = self;
     assert((s->id != from) && "Send to self");
-    int res;
 
-    res = _read_all(s->chs[from].read_fd, (char*)msg, sizeof(msg->s_header));
-    if (res != 0) return res;
-    assert((msg->s_header.s_magic == MESSAGE_MAGIC) && "Bad message magic");
+    if (s->replay != NULL) {
+        if (_replay_header(s, &msg->s_header) != 0) return -1;
+        if (s->last_src != from) {
+            // the account logic took another turn than in the recorded run
+            errno = EPROTO;
+            return -1;
+        }
+        receive_payload(s, msg->s_payload);
+        return 0;
+    }
 
-    res = _read_all(s->chs[from].read_fd, (char*)msg + sizeof(msg->s_header), msg->s_header.s_payload_len);
-    if (res != 0) return res;
+    if (s->transport == TRANSPORT_SHM) {
+        if (_ring_wait_header(s, from, &msg->s_header) != 0) return -1;
+    } else {
+        while (_peek_frame(s, from, &msg->s_header, &s->last_time) != 0) {
+            if (s->chs[from].read_fd == -1) {
+                // from has not linked to us yet, other siblings may connect first
+                if (_wait_fd(s->listen_fd, POLLIN) != 0 || accept_lazy_channels(s) != 0) return -1;
+                continue;
+            }
+            ssize_t recv = _fill_rx(&s->chs[from]);
+            if (recv > 0) continue;
+            if (recv == 0) return -1;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                process_stats->eagain_retries++;
+                if (_wait_fd(s->chs[from].read_fd, POLLIN) != 0) return -1;
+            } else if (errno != EINTR) {
+                return -1;
+            }
+        }
+    }
 
+    _consume_frame(s, from, msg->s_payload);
+    s->last_src = from;
     return 0;
 }
 
 int receive_any(void* self, Message* msg) {
+    if (receive_any_header(self, &msg->s_header) != 0) return -1;
+    receive_payload(self, msg->s_payload);
+    return 0;
+}
+
+int receive_any_header(void* self, MessageHeader* header) {
     Worker* s = self;
-    int res;
+    struct epoll_event events[MAX_PROCESS_ID + 1];
+
+    if (s->replay != NULL) return _replay_header(s, header);
+    if (s->transport == TRANSPORT_SHM) return _ring_wait_any_header(s, header);
+
+    // frames already read ahead never show up in epoll again
+    if (_pick_frame(s, header) == 0) return 0;
 
+    int64_t blocked_since = stats_now_ns();
     while (1) {
-        for (worker_id nbr_id = 0; nbr_id < s->nbr_count + 1; nbr_id++) {
-            if (nbr_id == s->id) continue;
+        process_stats->syscalls++;
+        process_stats->waits++;
+        int ready = epoll_wait(s->epoll_fd, events, MAX_PROCESS_ID + 1, -1);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
 
-            ssize_t recv = read(s->chs[nbr_id].read_fd, (char*)msg, sizeof(msg->s_header));
-            if (recv > 0) {
-                res = _read_all(s->chs[nbr_id].read_fd, (char*)msg + recv, sizeof(msg->s_header) - recv);
-                if (res != 0) return res;
-                assert((msg->s_header.s_magic == MESSAGE_MAGIC) && "Bad message magic");
+        for (int i = 0; i < ready; i++) {
+            worker_id nbr_id = events[i].data.u32;
 
-                res = _read_all(s->chs[nbr_id].read_fd, (char*)msg + sizeof(msg->s_header), msg->s_header.s_payload_len);
-                if (res != 0) return res;
+            if (events[i].data.u32 == LISTEN_EPOLL_ID) {
+                if (accept_lazy_channels(s) != 0) return -1;
+                continue;
+            }
 
-                return 0;
-            } else if (recv < 0) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                    continue;
-                } else if (errno == EINTR) {
-                    nbr_id--;
-                } else {
-                    return -1;
-                }
+            // every ready channel is read before one is picked, so the turns see all of them
+            ssize_t recv = _fill_rx(&s->chs[nbr_id]);
+            if (recv > 0) {
+                continue;
+            } else if (recv == 0) {
+                // peer closed its end, stop waking up on the hang-up
+                process_stats->syscalls++;
+                if (epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, s->chs[nbr_id].read_fd, NULL) != 0) return -1;
+            } else if (errno == EINTR) {
+                i--;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -1;
+            } else {
+                process_stats->eagain_retries++;
             }
         }
-        spin();
+        if (_pick_frame(s, header) == 0) {
+            histogram_record(&process_stats->receive_any_blocked, stats_now_ns() - blocked_since);
+            return 0;
+        }
     }
     return 0;
 }
 
-static int _read_all(int fd, char* buf, size_t size) {
-    size_t recv_total = 0;
-    while (recv_total < size) {
-        ssize_t recv = read(fd, buf + recv_total, size - recv_total);
-        if (recv > 0) {
-            recv_total += recv;
-        } else if (recv < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                spin();
-                continue;
-            } else if (errno == EINTR) {
-                continue;
-            } else {
-                return -1;
-            }
-        } else {
-            return -1;
+void receive_payload(void* self, void* payload) {
+    Worker* s = self;
+
+    if (s->replay != NULL) {
+        const TraceRecord* record = s->replay->received;
+        if (payload != NULL) memcpy(payload, record->s_payload, record->s_header.s_payload_len);
+        return;
+    }
+    _consume_frame(s, s->last_src, payload);
+}
+
+static int _wait_fd(int fd, short events) {
+    struct pollfd pfd = { .fd = fd, .events = events };
+    process_stats->waits++;
+    process_stats->syscalls++;
+    while (poll(&pfd, 1, -1) < 0) {
+        process_stats->syscalls++;
+        if (errno != EINTR) return -1;
+    }
+    return 0;
+}
+
+/* Reads as much as fits into the channel buffer with a single read(), same return contract as read() */
+static ssize_t _fill_rx(Channel* ch) {
+    if (ch->rx_buf == NULL) {
+        ch->rx_buf = malloc(CHANNEL_RX_BUFFER_LEN);
+        if (ch->rx_buf == NULL) return -1;
+    }
+    if (ch->rx_head == ch->rx_tail) {
+        ch->rx_head = ch->rx_tail = 0;
+    } else if (CHANNEL_RX_BUFFER_LEN - ch->rx_tail < MAX_FRAME_LEN) {
+        memmove(ch->rx_buf, ch->rx_buf + ch->rx_head, ch->rx_tail - ch->rx_head);
+        ch->rx_tail -= ch->rx_head;
+        ch->rx_head = 0;
+    }
+
+    process_stats->syscalls++;
+    ssize_t recv = read(ch->read_fd, ch->rx_buf + ch->rx_tail, CHANNEL_RX_BUFFER_LEN - ch->rx_tail);
+    if (recv > 0) ch->rx_tail += recv;
+    return recv;
+}
+
+/* Bytes in front of the payload: the header, then the upper half of the Lamport time with a wide clock */
+static size_t _frame_prefix_len(const Worker* s) {
+    return sizeof(MessageHeader) + (s->wide_clock ? sizeof(uint16_t) : 0);
+}
+
+/* Copies out the header and the full Lamport time of the first frame queued from a peer
+ * if the whole frame is there, 1 otherwise */
+static int _peek_frame(Worker* s, local_id from, MessageHeader* header, lamport_time_t* local_time) {
+    size_t prefix_len = _frame_prefix_len(s);
+    uint16_t time_hi = 0;
+
+    if (s->transport == TRANSPORT_SHM) {
+        Ring* ring = s->chs[from].rx;
+        // frames are published whole, so a visible header means a visible payload
+        if (ring_readable(ring) < prefix_len) return 1;
+        ring_peek(ring, 0, header, sizeof(*header));
+        if (s->wide_clock) ring_peek(ring, sizeof(*header), &time_hi, sizeof(time_hi));
+    } else {
+        Channel* ch = &s->chs[from];
+        size_t buffered = ch->rx_tail - ch->rx_head;
+
+        if (buffered < prefix_len) return 1;
+        memcpy(header, ch->rx_buf + ch->rx_head, sizeof(*header));
+        if (buffered < prefix_len + header->s_payload_len) return 1;
+        if (s->wide_clock) memcpy(&time_hi, ch->rx_buf + ch->rx_head + sizeof(*header), sizeof(time_hi));
+    }
+    assert((header->s_magic == MESSAGE_MAGIC) && "Bad message magic");
+
+    *local_time = ((lamport_time_t)time_hi << 16) | (uint16_t)header->s_local_time;
+    return 0;
+}
+
+/* Chooses the frame receive_any hands out among those buffered, 1 if there is none. Peers take turns starting at
+ * Worker.rx_next. A priority frame further on is taken instead, unless the turn has been passed over too often */
+static int _pick_frame(Worker* s, MessageHeader* header) {
+    int count = s->nbr_count + 1;
+    worker_id turn = -1, pick = -1;
+    MessageHeader turn_header, frame;
+    lamport_time_t turn_time, time;
+
+    for (int i = 0; i < count; i++) {
+        worker_id nbr_id = (s->rx_next + i) % count;
+        if (nbr_id == s->id || _peek_frame(s, nbr_id, &frame, &time) != 0) continue;
+
+        bool priority = frame.s_type >= 0 && frame.s_type < 32 && (s->rx_priority & (1u << frame.s_type));
+        if (turn == -1) {
+            turn = nbr_id;
+            turn_header = frame;
+            turn_time = time;
+        }
+        if (priority) {
+            pick = nbr_id;
+            *header = frame;
+            s->last_time = time;
+            break;
         }
+        if (s->rx_priority == 0 || s->rx_skips >= RX_PRIORITY_MAX_SKIPS) break;
     }
+    if (turn == -1) return 1;
+
+    if (pick == -1 || pick == turn) {
+        // the turn is served, the next peer is up
+        pick = turn;
+        *header = turn_header;
+        s->last_time = turn_time;
+        s->rx_skips = 0;
+        s->rx_next = (turn + 1) % count;
+    } else {
+        // the peer whose turn it was keeps it
+        s->rx_skips++;
+        s->rx_next = turn;
+    }
+    s->last_src = pick;
     return 0;
 }
 
-static int _write_all(int fd, const char* buf, size_t size) {
-    size_t sent_total = 0;
-    while (sent_total < size) {
-        ssize_t sent = write(fd, buf + sent_total, size - sent_total);
+/* Drops the frame found by _peek_frame, copying its payload to payload unless it is NULL */
+static void _consume_frame(Worker* s, local_id from, void* payload) {
+    size_t prefix_len = _frame_prefix_len(s);
+    MessageHeader header;
+    char traced[MAX_PAYLOAD_LEN];
+
+    // a trace keeps the payloads the caller has no use for as well
+    if (payload == NULL && s->trace != NULL) payload = traced;
+
+    if (s->transport == TRANSPORT_SHM) {
+        Ring* ring = s->chs[from].rx;
+        ring_peek(ring, 0, &header, sizeof(header));
+        if (payload != NULL) ring_peek(ring, prefix_len, payload, header.s_payload_len);
+        ring_consume(ring, prefix_len + header.s_payload_len);
+    } else {
+        Channel* ch = &s->chs[from];
+        memcpy(&header, ch->rx_buf + ch->rx_head, sizeof(header));
+        if (payload != NULL) memcpy(payload, ch->rx_buf + ch->rx_head + prefix_len, header.s_payload_len);
+        ch->rx_head += prefix_len + header.s_payload_len;
+    }
+    stats_count_message(process_stats->received_from, process_stats->received_by_type, from, header.s_type, prefix_len + header.s_payload_len);
+    if (s->trace != NULL) trace_append(s->trace, TRACE_RECEIVED, from, s->last_time, &header, payload);
+}
+
+static int _writev_all(int fd, struct iovec* iov, int iovcnt) {
+    int64_t blocked_since = 0;
+
+    while (iovcnt > 0) {
+        process_stats->syscalls++;
+        ssize_t sent = writev(fd, iov, iovcnt);
         if (sent > 0) {
-            sent_total += sent;
+            while (iovcnt > 0 && (size_t)sent >= iov->iov_len) {
+                sent -= iov->iov_len;
+                iov++;
+                iovcnt--;
+            }
+            if (iovcnt > 0) {
+                iov->iov_base = (char*)iov->iov_base + sent;
+                iov->iov_len -= sent;
+            }
         } else if (sent < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                spin();
+                process_stats->eagain_retries++;
+                if (blocked_since == 0) blocked_since = stats_now_ns();
+                if (_wait_fd(fd, POLLOUT) != 0) return -1;
                 continue;
             } else if (errno == EINTR) {
                 continue;
@@ -129,5 +366,69 @@ static int _write_all(int fd, const char* buf, size_t size) {
             return -1;
         }
     }
+    if (blocked_since != 0) histogram_record(&process_stats->send_blocked, stats_now_ns() - blocked_since);
+    return 0;
+}
+
+static int _ring_writev_all(Worker* s, local_id dst, const struct iovec* iov, int iovcnt) {
+    Ring* ring = s->chs[dst].tx;
+    int64_t blocked_since = 0;
+
+    while (1) {
+        uint32_t seq = doorbell_seq(&ring->space);
+        if (ring_try_writev(ring, iov, iovcnt) == 0) break;
+        if (blocked_since == 0) blocked_since = stats_now_ns();
+        process_stats->waits++;
+        if (_ring_wait(s, &ring->space, seq) != 0) return -1;
+    }
+    doorbell_ring(&s->bells[dst]);
+    if (blocked_since != 0) histogram_record(&process_stats->send_blocked, stats_now_ns() - blocked_since);
+    return 0;
+}
+
+static int _ring_wait(Worker* s, Doorbell* bell, uint32_t seq) {
+    if (!s->busy_poll) return doorbell_wait(bell, seq);
+    doorbell_poll(bell, seq);
+    return 0;
+}
+
+static int _ring_wait_header(Worker* s, local_id from, MessageHeader* header) {
+    while (1) {
+        uint32_t seq = doorbell_seq(&s->bells[s->id]);
+        for (int check = 0; check < RING_SPIN_CHECKS; check++) {
+            if (_peek_frame(s, from, header, &s->last_time) == 0) return 0;
+        }
+        process_stats->waits++;
+        if (_ring_wait(s, &s->bells[s->id], seq) != 0) return -1;
+    }
+}
+
+static int _ring_wait_any_header(Worker* s, MessageHeader* header) {
+    int64_t blocked_since = 0;
+
+    while (1) {
+        uint32_t seq = doorbell_seq(&s->bells[s->id]);
+        for (int check = 0; check < RING_SPIN_CHECKS; check++) {
+            if (_pick_frame(s, header) == 0) {
+                if (blocked_since != 0) histogram_record(&process_stats->receive_any_blocked, stats_now_ns() - blocked_since);
+                return 0;
+            }
+            if (blocked_since == 0) blocked_since = stats_now_ns();
+        }
+        process_stats->waits++;
+        if (_ring_wait(s, &s->bells[s->id], seq) != 0) return -1;
+    }
+}
+
+/* Hands out the next received message of the trace as if it had just arrived */
+static int _replay_header(Worker* s, MessageHeader* header) {
+    const TraceRecord* record = trace_next_received(s->replay);
+    if (record == NULL) {
+        errno = ENODATA;
+        return -1;
+    }
+    *header = record->s_header;
+    s->last_src = record->s_peer;
+    s->last_time = record->s_time;
     return 0;
 }
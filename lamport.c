@@ -1,18 +1,28 @@
 #include "banking.h"
+#include "lamport.h"
 
-static timestamp_t lamport_clock = 0;
+// every thread of --threads is a process of its own as far as Lamport time goes
+static __thread lamport_time_t lamport_clock = 0;
 
 timestamp_t get_lamport_time(void) {
     return lamport_clock;
 }
 
+lamport_time_t get_lamport_time_wide(void) {
+    return lamport_clock;
+}
+
 void increment_lamport_time(void) {
     lamport_clock++;
 }
 
-void update_lamport_time(timestamp_t received_time) {
+void update_lamport_time(lamport_time_t received_time) {
     if (received_time > lamport_clock) {
         lamport_clock = received_time;
     }
     lamport_clock++;
 }
+
+lamport_time_t lamport_widen(timestamp_t low, lamport_time_t reference) {
+    return reference - (uint16_t)((uint16_t)reference - (uint16_t)low);
+}
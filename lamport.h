@@ -1,10 +1,23 @@
 #ifndef __IFMO_DISTRIBUTED_CLASS_LAMPORT__H
 #define __IFMO_DISTRIBUTED_CLASS_LAMPORT__H
 
+#include <stdint.h>
+
 #include "ipc.h"
 
+/**
+ * Lamport time as the clock keeps it. timestamp_t on the wire and in banking.h
+ * only carries its lower 16 bits.
+ */
+typedef uint32_t lamport_time_t;
+
+lamport_time_t get_lamport_time_wide(void);
+
 void increment_lamport_time(void);
 
-void update_lamport_time(timestamp_t received_time);
+void update_lamport_time(lamport_time_t received_time);
+
+/** @return the latest time not after reference whose lower 16 bits are low */
+lamport_time_t lamport_widen(timestamp_t low, lamport_time_t reference);
 
 #endif // __IFMO_DISTRIBUTED_CLASS_LAMPORT__H
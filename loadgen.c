@@ -0,0 +1,149 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <time.h>
+
+#include "audit.h"
+#include "loadgen.h"
+
+static int64_t _now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* xorshift64*, so a seed reproduces the same stream everywhere */
+static uint64_t _next_random(LoadGenerator* g) {
+    g->rng ^= g->rng >> 12;
+    g->rng ^= g->rng << 25;
+    g->rng ^= g->rng >> 27;
+    return g->rng * 2685821657736338717ULL;
+}
+
+static local_id _draw_account(LoadGenerator* g) {
+    if (g->distribution == LOAD_ZIPF) {
+        double u = (_next_random(g) >> 11) * (1.0 / 9007199254740992.0);
+        for (local_id rank = 1; rank < g->accounts; rank++) {
+            if (u < g->zipf_cdf[rank]) return g->first + rank - 1;
+        }
+        return g->first + g->accounts - 1;
+    }
+    return g->first + _next_random(g) % g->accounts;
+}
+
+static int _compare_ns(const void* a, const void* b) {
+    int64_t lhs = *(const int64_t*)a, rhs = *(const int64_t*)b;
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+int load_init(LoadGenerator* g, int transfers, uint64_t seed, LoadDistribution distribution, local_id first, local_id accounts, const balance_t* initial_balances) {
+    *g = (LoadGenerator) { .transfers = transfers, .distribution = distribution, .first = first, .accounts = accounts, .rng = seed ? seed : 1 };
+
+    g->latency_ns = malloc(transfers * sizeof(int64_t));
+    g->next_to_dst = malloc(transfers * sizeof(int));
+    if (g->latency_ns == NULL || g->next_to_dst == NULL) {
+        load_deinit(g);
+        return -1;
+    }
+
+    double weight_sum = 0;
+    for (local_id rank = 1; rank <= accounts; rank++) {
+        local_id id = first + rank - 1;
+        g->balances[id] = initial_balances[id];
+        g->initial_total += initial_balances[id];
+        // classic Zipf, the weight of rank k is 1/k
+        weight_sum += 1.0 / rank;
+        g->zipf_cdf[rank] = weight_sum;
+        g->queue_head[id] = g->queue_tail[id] = -1;
+    }
+    for (local_id rank = 1; rank <= accounts; rank++) g->zipf_cdf[rank] /= weight_sum;
+    return 0;
+}
+
+void load_run(LoadGenerator* g, void* parent_data) {
+    local_id ring_src = g->first;
+
+    // a transfer needs two accounts and money to move
+    if (g->accounts < 2 || g->initial_total <= 0) g->transfers = 0;
+
+    g->started_ns = _now_ns();
+    for (int i = 0; i < g->transfers; i++) {
+        local_id src, dst;
+
+        if (g->distribution == LOAD_RING) {
+            // skip broke accounts, someone always has money since the total is conserved
+            while (g->balances[ring_src] == 0) ring_src = g->first + (ring_src - g->first + 1) % g->accounts;
+            src = ring_src;
+            dst = g->first + (ring_src - g->first + 1) % g->accounts;
+            ring_src = dst;
+        } else {
+            do {
+                src = _draw_account(g);
+                dst = _draw_account(g);
+            } while (src == dst || g->balances[src] == 0);
+        }
+
+        balance_t amount = 1 + _next_random(g) % LOAD_MAX_AMOUNT;
+        if (amount > g->balances[src]) amount = g->balances[src];
+        g->balances[src] -= amount;
+        g->balances[dst] += amount;
+
+        // queued before transfer(), which may already wait for ACKs
+        g->latency_ns[i] = _now_ns();
+        g->next_to_dst[i] = -1;
+        if (g->queue_tail[dst] == -1) {
+            g->queue_head[dst] = i;
+        } else {
+            g->next_to_dst[g->queue_tail[dst]] = i;
+        }
+        g->queue_tail[dst] = i;
+
+        transfer(parent_data, src, dst, amount);
+    }
+}
+
+void load_on_ack(LoadGenerator* g, local_id dst, int count) {
+    int64_t now = _now_ns();
+    for (int i = 0; i < count && g->queue_head[dst] != -1; i++) {
+        int acked = g->queue_head[dst];
+        g->latency_ns[acked] = now - g->latency_ns[acked];
+        g->queue_head[dst] = g->next_to_dst[acked];
+        if (g->queue_head[dst] == -1) g->queue_tail[dst] = -1;
+        g->acked++;
+    }
+    g->last_ack_ns = now;
+}
+
+void load_merge(LoadGenerator* into, const LoadGenerator* from) {
+    for (int i = 0; i < from->acked; i++) into->latency_ns[into->acked + i] = from->latency_ns[i];
+    if (into->acked == 0 || from->started_ns < into->started_ns) into->started_ns = from->started_ns;
+    if (from->last_ack_ns > into->last_ack_ns) into->last_ack_ns = from->last_ack_ns;
+    into->acked += from->acked;
+}
+
+void load_report(LoadGenerator* g, const AllHistory* history, FILE* out) {
+    double seconds = (g->last_ack_ns - g->started_ns) / 1e9;
+    fprintf(out, "load: %d transfers in %.3f ms, %.0f transfers/s\n", g->acked, seconds * 1e3, (seconds > 0) ? g->acked / seconds : 0);
+
+    if (g->acked > 0) {
+        qsort(g->latency_ns, g->acked, sizeof(int64_t), _compare_ns);
+        fprintf(out, "load: ACK latency, us: p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n", g->latency_ns[g->acked / 2] / 1e3,
+            g->latency_ns[g->acked * 9 / 10] / 1e3, g->latency_ns[g->acked * 99 / 100] / 1e3, g->latency_ns[g->acked - 1] / 1e3);
+    }
+
+    if (history == NULL) return;
+
+    // histories are aligned by now, so every account has an entry at each time
+    AuditResult audit;
+    if (audit_all_history(history, g->initial_total, &audit) != 0) {
+        fprintf(out, "load: conservation violated at t=%u, total $%d instead of $%d\n", audit.first_violation, audit.total, g->initial_total);
+        return;
+    }
+    fprintf(out, "load: conservation ok, total $%d at every t\n", g->initial_total);
+}
+
+void load_deinit(LoadGenerator* g) {
+    free(g->latency_ns);
+    free(g->next_to_dst);
+    g->latency_ns = NULL;
+    g->next_to_dst = NULL;
+}
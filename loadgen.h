@@ -0,0 +1,66 @@
+#ifndef __IFMO_DISTRIBUTED_CLASS_LOADGEN__H
+#define __IFMO_DISTRIBUTED_CLASS_LOADGEN__H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "banking.h"
+
+typedef enum {
+    LOAD_UNIFORM = 0, // src and dst drawn uniformly
+    LOAD_ZIPF,        // src and dst drawn by Zipf rank, account 1 is the hottest
+    LOAD_RING,        // src walks the accounts in order, dst is the next one
+} LoadDistribution;
+
+enum {
+    LOAD_MAX_AMOUNT = 5 ///< largest amount of a generated transfer
+};
+
+/**
+ * Built-in bank_robbery() replacement issuing a configurable stream of transfers.
+ * It keeps a model of every balance so it never orders more than the source holds,
+ * and measures the time from issuing each transfer to its ACK.
+ */
+typedef struct {
+    int transfers;
+    LoadDistribution distribution;
+    local_id first;    ///< lowest account id the generator moves money between, both source and destination
+    local_id accounts; ///< accounts from first on, ranked by their distance from first for Zipf
+    uint64_t rng;
+    balance_t initial_total;
+    balance_t balances[MAX_PROCESS_ID + 1]; ///< model of what every account holds once all transfers are applied
+    double zipf_cdf[MAX_PROCESS_ID + 1]; ///< by rank, starting at 1
+    int64_t started_ns;
+    int64_t last_ack_ns;
+    int acked;
+    int64_t* latency_ns; ///< issue time of each transfer until it is acknowledged, the latency afterwards
+    int* next_to_dst;    ///< links transfers to the same destination into a FIFO of unacknowledged ones
+    int queue_head[MAX_PROCESS_ID + 1];
+    int queue_tail[MAX_PROCESS_ID + 1];
+} LoadGenerator;
+
+/** Sets up a generator moving money between accounts [first, first + accounts), which nobody else may transfer from.
+ *  Both ends of every transfer lie in that range, so generators of disjoint blocks never move money between
+ *  the blocks, and a block needs two accounts for any transfer to happen. Under --issuers each issuer runs one.
+ *
+ * @return 0 on success, -1 if the buffers for transfers could not be allocated
+ */
+int load_init(LoadGenerator* g, int transfers, uint64_t seed, LoadDistribution distribution, local_id first, local_id accounts, const balance_t* initial_balances);
+
+/** Issues every transfer through transfer(parent_data, ...) */
+void load_run(LoadGenerator* g, void* parent_data);
+
+/** Accounts for count ACKs from dst. ACKs are matched to the oldest unacknowledged transfers to dst. */
+void load_on_ack(LoadGenerator* g, local_id dst, int count);
+
+/** Adds the transfers of a generator that has seen all its ACKs to into, which has room for every transfer of the run.
+ *  Generators running over parts of the accounts are reported as one that way.
+ */
+void load_merge(LoadGenerator* into, const LoadGenerator* from);
+
+/** Prints throughput, ACK latency percentiles and, unless history is NULL, whether the total balance was conserved at every time in it */
+void load_report(LoadGenerator* g, const AllHistory* history, FILE* out);
+
+void load_deinit(LoadGenerator* g);
+
+#endif // __IFMO_DISTRIBUTED_CLASS_LOADGEN__H
@@ -0,0 +1,144 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+static Logger* open_loggers[LOGGER_MAX_OPEN];
+
+static const int fatal_signals[] = { SIGABRT, SIGBUS, SIGFPE, SIGILL, SIGINT, SIGSEGV, SIGTERM };
+
+static int64_t _monotonic_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* Only write() is used, so this is safe to call from a signal handler */
+static int _write_all(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, buf, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += written;
+        len -= written;
+    }
+    return 0;
+}
+
+static void _flush_open_loggers(void) {
+    for (int i = 0; i < LOGGER_MAX_OPEN; i++) {
+        if (open_loggers[i] != NULL) logger_flush(open_loggers[i]);
+    }
+}
+
+static void _flush_on_fatal_signal(int sig) {
+    int saved_errno = errno;
+    // nothing but write(2) here, the buffers go out as they are since the process is going away
+    for (int i = 0; i < LOGGER_MAX_OPEN; i++) {
+        Logger* l = open_loggers[i];
+        if (l != NULL && l->len > 0) _write_all(l->fd, l->buf, l->len);
+    }
+    errno = saved_errno;
+    // the handler was reset on entry, so this terminates with the original signal
+    raise(sig);
+}
+
+static void _install_exit_handlers(void) {
+    static bool installed = false;
+    if (installed) return;
+    installed = true;
+
+    atexit(_flush_open_loggers);
+
+    struct sigaction action = { .sa_handler = _flush_on_fatal_signal, .sa_flags = SA_RESETHAND };
+    sigemptyset(&action.sa_mask);
+    for (size_t i = 0; i < sizeof(fatal_signals) / sizeof(fatal_signals[0]); i++) {
+        struct sigaction previous;
+        // leave signals the caller set up on their own alone
+        if (sigaction(fatal_signals[i], NULL, &previous) == 0 && previous.sa_handler == SIG_DFL) {
+            sigaction(fatal_signals[i], &action, NULL);
+        }
+    }
+}
+
+Logger* logger_open(const char* path) {
+    int slot = 0;
+    while (slot < LOGGER_MAX_OPEN && open_loggers[slot] != NULL) slot++;
+    if (slot == LOGGER_MAX_OPEN) {
+        errno = EMFILE;
+        return NULL;
+    }
+
+    Logger* l = malloc(sizeof(Logger));
+    if (l == NULL) return NULL;
+
+    l->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (l->fd == -1) {
+        free(l);
+        return NULL;
+    }
+    l->len = 0;
+    l->first_line_ms = 0;
+
+    _install_exit_handlers();
+    open_loggers[slot] = l;
+    return l;
+}
+
+void logger_write(Logger* l, const char* text, size_t len) {
+    if (l->len + len > LOGGER_BUFFER_LEN) logger_flush(l);
+    if (len > LOGGER_BUFFER_LEN) {
+        _write_all(l->fd, text, len);
+        return;
+    }
+
+    int64_t now_ms = _monotonic_ms();
+    if (l->len == 0) l->first_line_ms = now_ms;
+    memcpy(l->buf + l->len, text, len);
+    l->len += len;
+
+    if (now_ms - l->first_line_ms >= LOGGER_FLUSH_INTERVAL_MS) logger_flush(l);
+}
+
+void logger_printf(Logger* l, const char* fmt, ...) {
+    char line[LOGGER_MAX_LINE];
+    va_list args;
+
+    va_start(args, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+
+    if (len < 0) return;
+    if ((size_t)len >= sizeof(line)) len = sizeof(line) - 1;
+    logger_write(l, line, len);
+}
+
+int logger_flush(Logger* l) {
+    size_t len = l->len;
+    l->len = 0;
+    return _write_all(l->fd, l->buf, len);
+}
+
+void logger_discard(Logger* l) {
+    l->len = 0;
+}
+
+void logger_close(Logger* l) {
+    logger_flush(l);
+    for (int i = 0; i < LOGGER_MAX_OPEN; i++) {
+        if (open_loggers[i] == l) open_loggers[i] = NULL;
+    }
+    close(l->fd);
+    free(l);
+}
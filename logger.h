@@ -0,0 +1,53 @@
+#ifndef __IFMO_DISTRIBUTED_CLASS_LOGGER__H
+#define __IFMO_DISTRIBUTED_CLASS_LOGGER__H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+    LOGGER_BUFFER_LEN = 1 << 16,    ///< bytes buffered in memory before they are written out
+    LOGGER_MAX_LINE = 512,          ///< longest line logger_printf() formats, the rest is cut off
+    LOGGER_FLUSH_INTERVAL_MS = 100, ///< age of the oldest buffered line that forces a write, checked when the next line is added
+    LOGGER_MAX_OPEN = 20            ///< loggers one process can have open at a time, --threads opens one per account
+};
+
+/**
+ * Append-only log file written in batches. Lines are collected in a per-process buffer
+ * and written with one write() once the buffer fills up, the oldest line gets too old,
+ * or the process exits, including exits through a fatal signal.
+ * There is no timer: a line older than LOGGER_FLUSH_INTERVAL_MS stays buffered
+ * until the next line is logged or the logger is flushed.
+ *
+ * The buffer is plain process memory, so a logger must be flushed before fork().
+ */
+typedef struct {
+    int fd;
+    size_t len;
+    int64_t first_line_ms; ///< monotonic time the oldest buffered line was added at
+    char buf[LOGGER_BUFFER_LEN];
+} Logger;
+
+/** Opens path for appending, creating it if needed.
+ *
+ * @return the logger, NULL with errno set on failure
+ */
+Logger* logger_open(const char* path);
+
+/** Buffers len bytes of already formatted text */
+void logger_write(Logger* l, const char* text, size_t len);
+
+void logger_printf(Logger* l, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/** Writes out everything buffered so far.
+ *
+ * @return 0 on success, -1 with errno set if the file could not be written
+ */
+int logger_flush(Logger* l);
+
+/** Drops the buffered lines without writing them, e.g. the copy a child inherits from fork() */
+void logger_discard(Logger* l);
+
+/** Flushes and closes the logger, l is freed */
+void logger_close(Logger* l);
+
+#endif // __IFMO_DISTRIBUTED_CLASS_LOGGER__H
@@ -0,0 +1,55 @@
+#include <string.h>
+
+#include "mutex.h"
+
+static int _send_cs(Worker* w, local_id dst, MessageType type) {
+    increment_lamport_time();
+    MessageHeader header = { .s_magic = MESSAGE_MAGIC, .s_type = type, .s_local_time = get_lamport_time_wide() };
+    return send_iov(w, dst, &header, NULL);
+}
+
+void mutex_init(DistributedMutex* m) {
+    memset(m, 0, sizeof(*m));
+}
+
+int mutex_request(DistributedMutex* m, Worker* w) {
+    increment_lamport_time();
+    m->requesting = true;
+    m->requested_at = get_lamport_time_wide();
+    m->replies = 0;
+
+    // one timestamp for all of them, it is what the others order us by
+    MessageHeader header = { .s_magic = MESSAGE_MAGIC, .s_type = CS_REQUEST, .s_local_time = m->requested_at };
+    for (worker_id id = PARENT_ID + 1; id < w->nbr_count + 1; id++) {
+        if (id == w->id) continue;
+        if (send_iov(w, id, &header, NULL) != 0) return -1;
+    }
+    return 0;
+}
+
+bool mutex_granted(const DistributedMutex* m, const Worker* w) {
+    return m->requesting && m->replies == w->nbr_count - 1;
+}
+
+int mutex_on_request(DistributedMutex* m, Worker* w, local_id from, lamport_time_t requested_at) {
+    bool ours_first = m->requesting && (m->requested_at < requested_at || (m->requested_at == requested_at && w->id < from));
+    if (ours_first) {
+        m->deferred[from] = true;
+        return 0;
+    }
+    return _send_cs(w, from, CS_REPLY);
+}
+
+void mutex_on_reply(DistributedMutex* m) {
+    m->replies++;
+}
+
+int mutex_release(DistributedMutex* m, Worker* w) {
+    m->requesting = false;
+    for (worker_id id = PARENT_ID + 1; id < w->nbr_count + 1; id++) {
+        if (!m->deferred[id]) continue;
+        m->deferred[id] = false;
+        if (_send_cs(w, id, CS_REPLY) != 0) return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,50 @@
+#ifndef __IFMO_DISTRIBUTED_CLASS_MUTEX__H
+#define __IFMO_DISTRIBUTED_CLASS_MUTEX__H
+
+#include <stdbool.h>
+
+#include "lamport.h"
+#include "worker.h"
+
+/**
+ * Ricart-Agrawala mutual exclusion among the accounts, the parent takes no part.
+ * A request goes to every other account, which replies right away unless it holds
+ * or wants the critical section with an earlier (Lamport time, id) pair, in which
+ * case the reply is held back until it leaves. An entry costs 2(N-1) messages and
+ * no CS_RELEASE is ever sent.
+ *
+ * The functions only send, the caller receives and hands CS_REQUEST and CS_REPLY over.
+ */
+typedef struct {
+    bool requesting;            ///< from mutex_request() until mutex_release()
+    lamport_time_t requested_at;
+    worker_id replies;          ///< CS_REPLY received for the current request
+    bool deferred[MAX_PROCESS_ID + 1]; ///< accounts whose request is answered on release
+} DistributedMutex;
+
+void mutex_init(DistributedMutex* m);
+
+/** Asks every other account for the critical section with a fresh Lamport time.
+ *
+ * @return 0 on success, -1 if a CS_REQUEST could not be sent
+ */
+int mutex_request(DistributedMutex* m, Worker* w);
+
+/** @return whether every other account has replied to the pending request */
+bool mutex_granted(const DistributedMutex* m, const Worker* w);
+
+/** Handles a CS_REQUEST of account from stamped with requested_at, replying or holding the reply back.
+ *
+ * @return 0 on success, -1 if the CS_REPLY could not be sent
+ */
+int mutex_on_request(DistributedMutex* m, Worker* w, local_id from, lamport_time_t requested_at);
+
+void mutex_on_reply(DistributedMutex* m);
+
+/** Leaves the critical section and sends the replies held back meanwhile.
+ *
+ * @return 0 on success, -1 if a CS_REPLY could not be sent
+ */
+int mutex_release(DistributedMutex* m, Worker* w);
+
+#endif // __IFMO_DISTRIBUTED_CLASS_MUTEX__H
@@ -1,5 +1,7 @@
 
+#include <dlfcn.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -10,368 +12,1619 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "audit.h"
 #include "banking.h"
 #include "common.h"
+#include "cpu.h"
+#include "eventlog.h"
+#include "history.h"
 #include "ipc.h"
 #include "lamport.h"
+#include "loadgen.h"
+#include "logger.h"
+#include "mutex.h"
 #include "pa2345.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "trace.h"
 #include "worker.h"
 
+// linked in from bank_robbery.c, or left out of a pa2 that only runs --scenario objects
+extern void bank_robbery(void* parent_data, local_id max_id) __attribute__((weak));
+
+typedef void (*BankRobbery)(void* parent_data, local_id max_id);
+
 #define defer_return(r) \
     do {                \
         result = r;     \
         goto defer;     \
     } while (0)
 
-void log_event(FILE* events_log, FILE* out, const char* fmt, ...) {
-    va_list args1, args2;
+void log_event(Logger* events_log, FILE* out, const char* fmt, ...) {
+    char line[LOGGER_MAX_LINE];
+    va_list args;
+
+    va_start(args, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
 
-    va_start(args1, fmt);
-    va_copy(args2, args1);
+    if (len < 0) return;
+    if ((size_t)len >= sizeof(line)) len = sizeof(line) - 1;
+    logger_write(events_log, line, len);
+    fwrite(line, 1, len, out);
+}
 
-    vfprintf(events_log, fmt, args1);
-    vfprintf(out, fmt, args2);
-    fflush(events_log);
+/* Logs one of the pa2345.h events to events.log, or as a record to events.bin, and echoes its line to out */
+static void log_record(Worker* w, FILE* out, EventRecord record) {
+    char line[LOGGER_MAX_LINE];
+    int len = event_format(&record, line, sizeof(line));
 
-    va_end(args1);
-    va_end(args2);
+    if (w->events_bin == NULL) {
+        logger_write(w->events_log, line, len);
+    } else if (event_log_append(w->events_bin, &record) != 0) {
+        log_event(w->events_log, stderr, "Process %1d dropped an event, %s is full\n", w->id, events_bin_log);
+    }
+    fwrite(line, 1, len, out);
 }
 
+/**
+ * TRANSFER frames between accounts carrying more than one order stamp each order
+ * with the Lamport time it was executed at the source.
+ */
+typedef struct {
+    TransferOrder s_order;
+    timestamp_t s_sent_at;
+} __attribute__((packed)) TimedTransferOrder;
+
+/**
+ * Cumulative ACK for a batched TRANSFER frame, a plain ACK stays empty and acknowledges one order.
+ */
+typedef struct {
+    local_id s_src;
+    uint16_t s_count;
+} __attribute__((packed)) TransferAck;
+
+static const char* const log_history_overflow_fmt = "Process %1d ran out of balance history at time %u, --long-run lifts the limit\n";
+
+enum {
+    MAX_TRANSFER_BATCH = MAX_PAYLOAD_LEN / sizeof(TimedTransferOrder), ///< orders per frame, so a forwarded group always fits
+    MUTEX_ITERATIONS_PER_ID = 5, ///< --mutexl: critical sections account i goes through, times i
+    HISTORY_STREAM_MAX_AGE_NS = 1000000, ///< --stream-history: age of the oldest queued delta that sends them once a TRANSFER is handled
+    RX_PRIORITY_TYPES = (1 << ACK) | (1 << CS_REPLY) ///< --rx-priority: what a sender is blocked on goes ahead of bulk frames
+};
+
+/**
+ * stats_now_ns() at the milestones of --startup-timing, 0 until reached.
+ */
+typedef struct {
+    int64_t main_ns;
+    int64_t setup_ns;    // logs opened
+    int64_t channels_ns; // init_workers() done
+    int64_t spawned_ns;  // every account forked or started as a thread
+    int64_t all_started_ns;
+    int64_t first_transfer_ns; // first TRANSFER frame sent
+} StartupTimes;
+
+typedef struct TransferIssuer TransferIssuer;
+typedef struct IssuerPool IssuerPool;
+
 typedef struct {
     Worker* worker;
     AllHistory history;
+    AccountHistory* long_histories; // --long-run or --stream-history: histories arriving in chunks or deltas, by account id, replace history
+    bool streamed; // --stream-history: BALANCE_HISTORY frames carry a HistoryDeltaFrame
+    worker_id started;
+    worker_id done;
+    int transfer_window; // max transfers awaiting ACK, 1 is stop-and-wait
+    int transfers_in_flight;
+    bool failed; // transfer() cannot return an error, the run fails once the robbery is over
+    int acks_pending[MAX_PROCESS_ID + 1]; // transfers in flight by destination
+    int batch_size; // orders packed into one TRANSFER frame per source
+    int batch_lens[MAX_PROCESS_ID + 1];
+    TransferOrder batches[MAX_PROCESS_ID + 1][MAX_TRANSFER_BATCH]; // orders not yet sent, by source
+    BankRobbery robbery; // bank_robbery() linked in or resolved from --scenario
+    LoadGenerator* load; // issues the transfers instead of robbery when set
+    StartupTimes* startup; // --startup-timing only
+    int snapshot_every; // transfers between two snapshots, 0 takes none
+    int transfers_issued;
+    balance_t initial_total; // what every snapshot has to add up to
+    SnapshotCollector snapshot;
+    bool audit; // check AllHistory for conservation after printing it
+    IssuerPool* pool; // --issuers: threads issue the transfers, the main thread receives their ACKs
+    TransferIssuer* issuer; // --issuers: this client is one of those threads
 } BankClientWorker;
 
-typedef struct {
-    timestamp_t sent_at;
-    timestamp_t received_at;
-    balance_t amount;
-} ReceivedTransfer;
+/**
+ * A thread of the parent issuing the transfers of a block of source accounts under --issuers.
+ * Only the main thread receives, it hands an issuer its ACKs through the counters here.
+ */
+struct TransferIssuer {
+    pthread_t thread;
+    int index;
+    BankClientWorker client; // batches, window and load generator of this issuer alone
+    LoadGenerator load;
+    TransferOrder* queued; // orders of bank_robbery() with a source of this issuer, run once by the main thread
+    int queued_len;
+    int queued_capacity;
+    ProcessStats stats; // added to the parent's once the issuer is joined
+    Doorbell acked; // rung by the main thread once it has added to acks
+    int acks[MAX_PROCESS_ID + 1]; // ACKed orders by destination the issuer has not taken yet
+    lamport_time_t ack_time; // time of the latest ACK handed over, the start time at first
+    lamport_time_t end_time; // Lamport time of the issuer once it is through
+    int status;
+};
+
+struct IssuerPool {
+    int count;
+    TransferIssuer* issuers;
+    int owner[MAX_PROCESS_ID + 1]; // issuer of each source account
+    Doorbell bell; // rung by issuers when they have sent orders or are through, wakes the main thread
+    int unacked; // orders sent by all issuers and not acknowledged yet
+    int finished; // issuers through with their share of the transfers
+};
 
 typedef struct {
     Worker* worker;
     balance_t balance;
-    BalanceHistory history;
-    ReceivedTransfer received_transfers[MAX_T];
-    int received_count;
+    AccountHistory* history; // grows during the run, so copies of the worker share it
+    worker_id started;
+    worker_id done;
+    bool stopped;
+    bool done_sent;
+    bool ack_source; // every ACK carries a TransferAck, so the parent knows which issuer it belongs to
+    DistributedMutex* mutex; // --mutexl only
+    SnapshotState snapshot;
+    HistoryDeltaFrame* stream; // --stream-history: room for HISTORY_DELTA_ENTRIES deltas not sent yet
+    size_t stream_len;
+    int64_t stream_first_ns; // when the oldest delta not sent yet was queued
 } BankAccountWorker;
 
-static balance_t calculate_pending_at(ReceivedTransfer* transfers, int count, timestamp_t t) {
-    balance_t pending = 0;
-    for (int i = 0; i < count; i++) {
-        if (transfers[i].sent_at <= t && t < transfers[i].received_at) {
-            pending += transfers[i].amount;
+/**
+ * How an account runs, the same for all of them.
+ */
+typedef struct {
+    lamport_time_t history_max_time;
+    bool mutexl;
+    bool stream_history;
+    bool record_trace;
+    bool wide_clock; // only written to the trace, the worker already knows
+    bool ack_source; // --issuers
+} AccountOptions;
+
+/* Sends the deltas collected so far as one BALANCE_HISTORY frame, the last one tells the parent we are through */
+static int flush_history_stream(BankAccountWorker* s, bool last) {
+    s->stream->s_last = last;
+    increment_lamport_time();
+    MessageHeader header = { .s_magic = MESSAGE_MAGIC, .s_type = BALANCE_HISTORY, .s_local_time = get_lamport_time_wide() };
+    header.s_payload_len = sizeof(HistoryDeltaFrame) + s->stream_len * sizeof(HistoryDelta);
+    if (send_iov(s->worker, PARENT_ID, &header, s->stream) != 0) {
+        log_event(s->worker->events_log, stderr, "Process %1d failed to send BALANCE_HISTORY message to %1d: %s\n", s->worker->id, PARENT_ID, strerror(errno));
+        return 1;
+    }
+    s->stream_len = 0;
+    return 0;
+}
+
+/* Applies a delta to our history and queues it for the parent under --stream-history */
+static int update_history(BankAccountWorker* s, HistoryDelta delta) {
+    if (account_history_apply(s->history, &delta) != 0) {
+        log_event(s->worker->events_log, stderr, log_history_overflow_fmt, s->worker->id, delta.s_time);
+        return 1;
+    }
+    if (s->stream == NULL) return 0;
+
+    if (s->stream_len == 0) s->stream_first_ns = stats_now_ns();
+    s->stream->s_deltas[s->stream_len++] = delta;
+    return (s->stream_len == HISTORY_DELTA_ENTRIES) ? flush_history_stream(s, false) : 0;
+}
+
+/* Sends the queued deltas once the oldest has waited long enough, a full frame may never come in a short run */
+static int flush_history_stream_if_due(BankAccountWorker* s) {
+    if (s->stream == NULL || s->stream_len == 0 || stats_now_ns() - s->stream_first_ns < HISTORY_STREAM_MAX_AGE_NS) return 0;
+    return flush_history_stream(s, false);
+}
+
+static int record_balance(BankAccountWorker* s, lamport_time_t to_time) {
+    return update_history(s, (HistoryDelta) { .s_time = to_time, .s_sent_at = HISTORY_DELTA_BALANCE, .s_value = s->balance });
+}
+
+/* Applies orders where we are the source, one Lamport tick each, and forwards them grouped by destination */
+static int execute_transfer_orders(BankAccountWorker* s, const TransferOrder* orders, size_t count) {
+    lamport_time_t sent_at[MAX_TRANSFER_BATCH];
+    TimedTransferOrder timed[MAX_TRANSFER_BATCH];
+
+    for (size_t i = 0; i < count; i++) {
+        increment_lamport_time();
+        sent_at[i] = get_lamport_time_wide();
+
+        s->balance -= orders[i].s_amount;
+        if (record_balance(s, sent_at[i]) != 0) return 1;
+    }
+
+    for (worker_id dst = PARENT_ID + 1; dst < s->worker->nbr_count + 1; dst++) {
+        size_t timed_count = 0;
+        lamport_time_t send_time = 0;
+
+        for (size_t i = 0; i < count; i++) {
+            if (orders[i].s_dst != dst) continue;
+            timed[timed_count++] = (TimedTransferOrder) { .s_order = orders[i], .s_sent_at = sent_at[i] };
+            send_time = sent_at[i];
         }
+        if (timed_count == 0) continue;
+
+        // a lone order goes out as a plain TransferOrder stamped by the header, which is the prefix of TimedTransferOrder
+        size_t payload_len = (timed_count == 1) ? sizeof(TransferOrder) : timed_count * sizeof(TimedTransferOrder);
+        MessageHeader header = { .s_magic = MESSAGE_MAGIC, .s_type = TRANSFER, .s_local_time = send_time, .s_payload_len = payload_len };
+        if (send_iov(s->worker, dst, &header, timed) != 0) {
+            log_event(s->worker->events_log, stderr, "Process %1d failed to send TRANSFER message to %1d: %s\n", s->worker->id, dst, strerror(errno));
+            return 1;
+        }
+        for (size_t i = 0; i < timed_count; i++) {
+            log_record(s->worker, stdout, (EventRecord) { .s_type = EVENT_TRANSFER_OUT, .s_time = lamport_widen(timed[i].s_sent_at, send_time), .s_process = s->worker->id, .s_amount = timed[i].s_order.s_amount, .s_peer = dst });
+        }
+    }
+    return 0;
+}
+
+/* Credits orders where we are the destination, received at timestamp, and acknowledges them to the parent at once */
+static int accept_transfer_orders(BankAccountWorker* s, const Message* msg, lamport_time_t timestamp) {
+    TimedTransferOrder single;
+    const TimedTransferOrder* timed = (const TimedTransferOrder*)msg->s_payload;
+    size_t count = msg->s_header.s_payload_len / sizeof(TimedTransferOrder);
+    TransferAck cumulative;
+
+    if (msg->s_header.s_payload_len == sizeof(TransferOrder)) {
+        memcpy(&single.s_order, msg->s_payload, sizeof(TransferOrder));
+        single.s_sent_at = msg->s_header.s_local_time;
+        timed = &single;
+        count = 1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        // orders of a frame are stamped shortly before the frame itself
+        lamport_time_t sent_at = lamport_widen(timed[i].s_sent_at, s->worker->last_time);
+        if (update_history(s, (HistoryDelta) { .s_time = timestamp, .s_sent_at = sent_at, .s_value = timed[i].s_order.s_amount }) != 0) return 1;
+        s->balance += timed[i].s_order.s_amount;
+        snapshot_on_transfer(&s->snapshot, timed[i].s_order.s_src, timed[i].s_order.s_amount);
+    }
+
+    if (record_balance(s, timestamp) != 0) return 1;
+
+    increment_lamport_time();
+    lamport_time_t ack_time = get_lamport_time_wide();
+    MessageHeader ack = { .s_magic = MESSAGE_MAGIC, .s_type = ACK, .s_local_time = ack_time };
+    if (timed != &single || s->ack_source) {
+        cumulative = (TransferAck) { .s_src = timed[0].s_order.s_src, .s_count = count };
+        ack.s_payload_len = sizeof(cumulative);
+    }
+    if (send_iov(s->worker, PARENT_ID, &ack, &cumulative) != 0) {
+        log_event(s->worker->events_log, stderr, "Process %1d failed to send ACK message to %1d: %s\n", s->worker->id, PARENT_ID, strerror(errno));
+        return 1;
     }
-    return pending;
+    for (size_t i = 0; i < count; i++) {
+        log_record(s->worker, stdout, (EventRecord) { .s_type = EVENT_TRANSFER_IN, .s_time = timestamp, .s_process = s->worker->id, .s_amount = timed[i].s_order.s_amount, .s_peer = timed[i].s_order.s_src });
+    }
+    return 0;
 }
 
-static void update_balance_history(BankAccountWorker* s, timestamp_t from_time, timestamp_t to_time, balance_t current_balance) {
-    balance_t base_balance = (s->history.s_history_len > 0) ? s->history.s_history[s->history.s_history_len - 1].s_balance : current_balance;
+/* Sends the history as one BalanceHistory, or as a series of HistoryChunk frames when it may outgrow one.
+ * A streamed history only has its tail left to send. */
+static int send_history(BankAccountWorker* s) {
+    MessageHeader header = { .s_magic = MESSAGE_MAGIC, .s_type = BALANCE_HISTORY };
+
+    if (s->stream != NULL) return flush_history_stream(s, true);
 
-    for (timestamp_t t = from_time; t <= to_time; t++) {
-        s->history.s_history[t].s_time = t;
-        s->history.s_history[t].s_balance = (t < to_time) ? base_balance : current_balance;
-        s->history.s_history[t].s_balance_pending_in = calculate_pending_at(s->received_transfers, s->received_count, t);
+    if (!s->worker->wide_clock) {
+        BalanceHistory history;
+        account_history_export(s->history, &history);
+        increment_lamport_time();
+        header.s_local_time = get_lamport_time();
+        header.s_payload_len = sizeof(history.s_id) + sizeof(history.s_history_len) + history.s_history_len * sizeof(BalanceState);
+        return send_iov(s->worker, PARENT_ID, &header, &history);
     }
-    s->history.s_history_len = to_time + 1;
+
+    char payload[MAX_PAYLOAD_LEN];
+    HistoryChunk* chunk = (HistoryChunk*)payload;
+    for (lamport_time_t first_time = 0; first_time < s->history->len; first_time += HISTORY_CHUNK_ENTRIES) {
+        increment_lamport_time();
+        header.s_local_time = get_lamport_time();
+        header.s_payload_len = account_history_chunk(s->history, first_time, chunk);
+        if (send_iov(s->worker, PARENT_ID, &header, chunk) != 0) return -1;
+    }
+    return 0;
 }
 
-int execute_bank_account_worker(BankAccountWorker s) {
-    timestamp_t timestamp;
+/* Multicasts DONE once the parent has said STOP and our --mutexl loop is over */
+static int send_done(BankAccountWorker* s) {
+    char text[128];
+
+    increment_lamport_time();
+    lamport_time_t done_time = get_lamport_time_wide();
+    EventRecord done_event = { .s_type = EVENT_DONE, .s_time = done_time, .s_process = s->worker->id, .s_amount = s->balance };
+    MessageHeader header = { .s_magic = MESSAGE_MAGIC, .s_type = DONE, .s_local_time = done_time };
+    header.s_payload_len = event_format(&done_event, text, sizeof(text));
+    if (send_multicast_iov(s->worker, &header, text) != 0) {
+        log_event(s->worker->events_log, stderr, "Process %1d failed to multicast DONE message: %s\n", s->worker->id, strerror(errno));
+        return 1;
+    }
+    log_record(s->worker, stdout, done_event);
+    s->done_sent = true;
+    return 0;
+}
+
+/* Receives and handles one message, request_cs() keeps the account going through here while it waits */
+static int receive_account_message(BankAccountWorker* s) {
+    lamport_time_t timestamp;
     Message msg;
-    size_t started = 0;
-    size_t done = 0;
+
+    if (receive_any(s->worker, &msg) != 0) {
+        log_event(s->worker->events_log, stderr, "Process %1d failed to receive message: %s\n", s->worker->id, strerror(errno));
+        return 1;
+    }
+    lamport_time_t sent_at = s->worker->last_time;
+    update_lamport_time(sent_at);
+    timestamp = get_lamport_time_wide();
+
+    switch (msg.s_header.s_type) {
+    case (STARTED): {
+        s->started++;
+        if (s->started == s->worker->nbr_count - 1) {
+            log_record(s->worker, stdout, (EventRecord) { .s_type = EVENT_RECEIVED_ALL_STARTED, .s_time = timestamp, .s_process = s->worker->id });
+        }
+    } break;
+    case (TRANSFER): {
+        const TransferOrder* order = (const TransferOrder*)msg.s_payload;
+
+        if (order->s_src == s->worker->id) {
+            if (execute_transfer_orders(s, order, msg.s_header.s_payload_len / sizeof(TransferOrder)) != 0) return 1;
+        } else {
+            if (accept_transfer_orders(s, &msg, timestamp) != 0) return 1;
+        }
+        if (flush_history_stream_if_due(s) != 0) return 1;
+    } break;
+    case (STOP): {
+        s->stopped = true;
+    } break;
+    case (DONE): {
+        s->done++;
+        if (s->done == s->worker->nbr_count - 1) {
+            log_record(s->worker, stdout, (EventRecord) { .s_type = EVENT_RECEIVED_ALL_DONE, .s_time = timestamp, .s_process = s->worker->id });
+        }
+    } break;
+    case (CS_REQUEST): {
+        if (s->mutex == NULL) goto unexpected;
+        if (mutex_on_request(s->mutex, s->worker, s->worker->last_src, sent_at) != 0) {
+            log_event(s->worker->events_log, stderr, "Process %1d failed to send CS_REPLY message to %1d: %s\n", s->worker->id, s->worker->last_src, strerror(errno));
+            return 1;
+        }
+    } break;
+    case (CS_REPLY): {
+        if (s->mutex == NULL) goto unexpected;
+        mutex_on_reply(s->mutex);
+    } break;
+    case (SNAPSHOT_MARKER): {
+        if (msg.s_header.s_payload_len != sizeof(SnapshotMarker)) goto unexpected;
+        if (snapshot_on_marker(&s->snapshot, s->worker, s->worker->last_src, (const SnapshotMarker*)msg.s_payload, s->balance) != 0) {
+            log_event(s->worker->events_log, stderr, "Process %1d failed to pass on snapshot marker: %s\n", s->worker->id, strerror(errno));
+            return 1;
+        }
+    } break;
+    default: {
+    unexpected:
+        log_event(s->worker->events_log, stderr, "Process %1d received unexpected message [%d]\n", s->worker->id, msg.s_header.s_type);
+        return 1;
+    } break;
+    }
+    return 0;
+}
+
+int request_cs(const void* self) {
+    // the pa2345.h signature is fixed, the account behind it is ours to change
+    BankAccountWorker* s = (BankAccountWorker*)self;
+    int64_t requested_ns = stats_now_ns();
+
+    if (process_stats->cs_first_request_ns == 0) process_stats->cs_first_request_ns = requested_ns;
+    if (mutex_request(s->mutex, s->worker) != 0) {
+        log_event(s->worker->events_log, stderr, "Process %1d failed to send CS_REQUEST message: %s\n", s->worker->id, strerror(errno));
+        return 1;
+    }
+    while (!mutex_granted(s->mutex, s->worker)) {
+        if (receive_account_message(s) != 0) return 1;
+    }
+    histogram_record(&process_stats->cs_wait, stats_now_ns() - requested_ns);
+    return 0;
+}
+
+int release_cs(const void* self) {
+    BankAccountWorker* s = (BankAccountWorker*)self;
+
+    if (mutex_release(s->mutex, s->worker) != 0) {
+        log_event(s->worker->events_log, stderr, "Process %1d failed to send CS_REPLY message: %s\n", s->worker->id, strerror(errno));
+        return 1;
+    }
+    process_stats->cs_last_release_ns = stats_now_ns();
+    return 0;
+}
+
+int execute_bank_account_worker(BankAccountWorker s) {
+    lamport_time_t timestamp;
+    MessageHeader header;
+    char text[128];
+    // --mutexl: the pa4 loop, account i prints i * 5 lines holding the critical section
+    int cs_iterations = (s.mutex != NULL) ? s.worker->id * MUTEX_ITERATIONS_PER_ID : 0;
+    int cs_iteration = 0;
 
     increment_lamport_time();
-    timestamp = get_lamport_time();
-    msg = (Message) { .s_header = { .s_magic = MESSAGE_MAGIC, .s_type = STARTED, .s_local_time = timestamp } };
-    sprintf(msg.s_payload, log_started_fmt, timestamp, s.worker->id, getpid(), getppid(), s.balance);
-    msg.s_header.s_payload_len = strlen(msg.s_payload);
-    if (send_multicast(s.worker, &msg) != 0) {
+    timestamp = get_lamport_time_wide();
+    EventRecord started_event = { .s_type = EVENT_STARTED, .s_time = timestamp, .s_process = s.worker->id, .s_pid = getpid(), .s_parent_pid = getppid(), .s_amount = s.balance };
+    header = (MessageHeader) { .s_magic = MESSAGE_MAGIC, .s_type = STARTED, .s_local_time = timestamp };
+    header.s_payload_len = event_format(&started_event, text, sizeof(text));
+    if (send_multicast_iov(s.worker, &header, text) != 0) {
         log_event(s.worker->events_log, stderr, "Process %1d failed to multicast STARTED message: %s\n", s.worker->id, strerror(errno));
         return 1;
     }
-    log_event(s.worker->events_log, stdout, log_started_fmt, timestamp, s.worker->id, getpid(), getppid(), s.balance);
+    log_record(s.worker, stdout, started_event);
 
-    while (started != s.worker->nbr_count - 1 || done != s.worker->nbr_count - 1) {
-        if (receive_any(s.worker, &msg) != 0) {
-            log_event(s.worker->events_log, stderr, "Process %1d failed to receive message: %s\n", s.worker->id, strerror(errno));
+    // the other accounts can be DONE before the parent's STOP reaches us, so STOP is awaited on its own.
+    // DONE waits for our critical sections too, whoever has seen every DONE is asked for no more replies
+    while (s.started != s.worker->nbr_count - 1 || s.done != s.worker->nbr_count - 1 || !s.done_sent) {
+        if (s.started == s.worker->nbr_count - 1 && cs_iteration < cs_iterations) {
+            cs_iteration++;
+            if (request_cs(&s) != 0) return 1;
+            snprintf(text, sizeof(text), log_loop_operation_fmt, s.worker->id, cs_iteration, cs_iterations);
+            print(text);
+            if (release_cs(&s) != 0) return 1;
+        } else if (s.stopped && !s.done_sent && cs_iteration == cs_iterations) {
+            if (send_done(&s) != 0) return 1;
+        } else if (receive_account_message(&s) != 0) {
             return 1;
         }
-        update_lamport_time(msg.s_header.s_local_time);
-        timestamp = get_lamport_time();
+    }
 
-        switch (msg.s_header.s_type) {
-        case (STARTED): {
-            started++;
-            if (started == s.worker->nbr_count - 1) {
-                log_event(s.worker->events_log, stdout, log_received_all_started_fmt, timestamp, s.worker->id);
-            }
-        } break;
-        case (TRANSFER): {
-            TransferOrder order = *(TransferOrder*)msg.s_payload;
+    if (record_balance(&s, get_lamport_time_wide()) != 0) return 1;
 
-            if (order.s_src == s.worker->id) {
-                increment_lamport_time();
-                timestamp_t send_time = get_lamport_time();
+    // the parent prints the history as soon as it arrives, so our buffered stdout has to land first
+    fflush(stdout);
 
-                s.balance -= order.s_amount;
+    if (send_history(&s) != 0) {
+        log_event(s.worker->events_log, stderr, "Process %1d failed to send BALANCE_HISTORY message to %1d: %s\n", s.worker->id, PARENT_ID, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
 
-                update_balance_history(&s, s.history.s_history_len, send_time, s.balance);
+/* Starts trace.<id>.bin with what a replay needs to run the process again */
+static TraceWriter* open_trace(worker_id id, worker_id nbr_count, balance_t balance, const AccountOptions* options) {
+    char path[32];
+    TraceHeader header = {
+        .magic = TRACE_MAGIC,
+        .version = TRACE_VERSION,
+        .id = id,
+        .nbr_count = nbr_count,
+        .wide_clock = options->wide_clock,
+        .mutexl = options->mutexl,
+        .stream_history = options->stream_history,
+        .ack_source = options->ack_source,
+        .balance = balance,
+        .history_max_time = options->history_max_time,
+    };
 
-                msg = (Message) { .s_header = { .s_magic = MESSAGE_MAGIC, .s_type = TRANSFER, .s_local_time = send_time, .s_payload_len = sizeof(TransferOrder) } };
-                memcpy(msg.s_payload, &order, sizeof(TransferOrder));
-                if (send(s.worker, order.s_dst, &msg) != 0) {
-                    log_event(s.worker->events_log, stderr, "Process %1d failed to send TRANSFER message to %1d: %s\n", s.worker->id, order.s_dst, strerror(errno));
-                    return 1;
-                }
-                log_event(s.worker->events_log, stdout, log_transfer_out_fmt, send_time, s.worker->id, order.s_amount, order.s_dst);
-            } else {
-                timestamp_t transfer_sent_time = msg.s_header.s_local_time;
+    snprintf(path, sizeof(path), trace_path_fmt, id);
+    TraceWriter* trace = trace_open(path, &header);
+    if (trace == NULL) fprintf(stderr, "Failed to open file %s: %s\n", path, strerror(errno));
+    return trace;
+}
+
+/* Body of an account process or thread, returns its exit status */
+static int run_bank_account(Worker* w, balance_t balance, const AccountOptions* options) {
+    AccountHistory history;
+    DistributedMutex mutex;
+    char stream[MAX_PAYLOAD_LEN];
+    BankAccountWorker bank_account_worker = {
+        .worker = w,
+        .balance = balance,
+        .history = &history,
+        .ack_source = options->ack_source,
+    };
+
+    if (options->mutexl) {
+        mutex_init(&mutex);
+        bank_account_worker.mutex = &mutex;
+    }
+    if (options->stream_history) bank_account_worker.stream = (HistoryDeltaFrame*)stream;
+
+    if (account_history_init(&history, w->id, balance, options->history_max_time) != 0) {
+        fprintf(stderr, "Failed to allocate the balance history of worker %d\n", w->id);
+        return 1;
+    }
+    if (options->record_trace) {
+        w->trace = open_trace(w->id, w->nbr_count, balance, options);
+        if (w->trace == NULL) {
+            account_history_free(&history);
+            return 1;
+        }
+    }
+    int status = execute_bank_account_worker(bank_account_worker);
+    if (w->trace != NULL) {
+        trace_close(w->trace);
+        w->trace = NULL;
+    }
+    account_history_free(&history);
+    return status;
+}
 
-                s.received_transfers[s.received_count].sent_at = transfer_sent_time;
-                s.received_transfers[s.received_count].received_at = timestamp;
-                s.received_transfers[s.received_count].amount = order.s_amount;
-                s.received_count++;
+/* Runs the account of a --record-trace file on the messages it received in the recorded run,
+ * comparing what it sends with what it sent then, and reports how long the account logic took */
+static int replay_bank_account(const char* path, bool paced) {
+    Worker w;
 
-                s.balance += order.s_amount;
+    TraceReader* trace = trace_load(path, paced);
+    if (trace == NULL) {
+        fprintf(stderr, "Failed to load trace %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    const TraceHeader* header = trace->header;
+    if (header->id == PARENT_ID) {
+        fprintf(stderr, "error: %s is the trace of the parent, only accounts can be replayed\n", path);
+        trace_unload(trace);
+        return 1;
+    }
 
-                update_balance_history(&s, s.history.s_history_len, timestamp, s.balance);
+    // events.log of the recorded run stays as it is, the replayed lines still go to stdout
+    Logger* events_log_fd = logger_open("/dev/null");
+    if (events_log_fd == NULL) {
+        fprintf(stderr, "Failed to open /dev/null: %s\n", strerror(errno));
+        trace_unload(trace);
+        return 1;
+    }
+    init_worker(&w, header->id, header->nbr_count, events_log_fd);
+    w.wide_clock = header->wide_clock;
+    w.replay = trace;
+    AccountOptions options = {
+        .history_max_time = header->history_max_time,
+        .mutexl = header->mutexl,
+        .stream_history = header->stream_history,
+        .ack_source = header->ack_source,
+    };
+
+    int64_t started_ns = stats_now_ns();
+    int status = run_bank_account(&w, header->balance, &options);
+    int64_t replay_ns = stats_now_ns() - started_ns;
+
+    uint64_t messages = trace->received_count + trace->sent_count;
+    bool replayed = trace_replayed(trace);
+    fprintf(stderr, "replay: account %d, %llu messages received and %llu sent in %.3f ms, %.0f ns per message%s\n", header->id,
+        (unsigned long long)trace->received_count, (unsigned long long)trace->sent_count, replay_ns / 1e6, (messages > 0) ? (double)replay_ns / messages : 0,
+        paced ? ", paced" : "");
+    if (trace->sent_mismatched == 0 && replayed) {
+        fprintf(stderr, "replay: all %llu sends match the trace\n", (unsigned long long)trace->sent_count);
+    } else {
+        fprintf(stderr, "replay: %llu of %llu sends differ from the trace%s\n", (unsigned long long)trace->sent_mismatched, (unsigned long long)trace->sent_count,
+            replayed ? "" : ", some recorded messages were not replayed");
+        if (status == 0) status = 1;
+    }
 
-                increment_lamport_time();
-                timestamp_t ack_time = get_lamport_time();
-                msg = (Message) { .s_header = { .s_magic = MESSAGE_MAGIC, .s_type = ACK, .s_local_time = ack_time } };
-                if (send(s.worker, PARENT_ID, &msg) != 0) {
-                    log_event(s.worker->events_log, stderr, "Process %1d failed to send TRANSFER message to %1d: %s\n", s.worker->id, PARENT_ID, strerror(errno));
+    free(w.chs);
+    logger_close(events_log_fd);
+    trace_unload(trace);
+    return status;
+}
+
+/* Moves the running process or thread to its CPU of the --pin plan, a no-op without one */
+static int pin_worker(const int* cpu_plan, worker_id id) {
+    if (cpu_plan == NULL) return 0;
+    if (cpu_pin(cpu_plan[id]) != 0) {
+        fprintf(stderr, "Failed to pin worker %d to CPU %d: %s\n", id, cpu_plan[id], strerror(errno));
+        return -1;
+    }
+    process_stats->cpu = cpu_current();
+    return 0;
+}
+
+/**
+ * An account running as a thread of the parent process under --threads.
+ */
+typedef struct {
+    pthread_t thread;
+    Worker* worker;
+    balance_t balance;
+    const AccountOptions* options;
+    ProcessStats* stats;
+    const int* cpu_plan; // --pin only
+    int status;
+} BankAccountThread;
+
+static void* bank_account_thread(void* arg) {
+    BankAccountThread* t = arg;
+    stats_attach(t->stats);
+    if (pin_worker(t->cpu_plan, t->worker->id) != 0) {
+        t->status = 1;
+        return NULL;
+    }
+    // rings need no per-thread set-up
+    process_stats->ready_ns = stats_now_ns();
+    t->status = run_bank_account(t->worker, t->balance, t->options);
+    // every write() is slowed down by the runtime library, so threads flush in parallel rather than one by one at join
+    logger_flush(t->worker->events_log);
+    return NULL;
+}
+
+static void print_snapshot(BankClientWorker* s, lamport_time_t timestamp) {
+    const SnapshotCollector* c = &s->snapshot;
+    balance_t total = c->balance + c->in_flight;
+
+    printf("snapshot %u at t=%u: accounts $%d + in flight $%d = $%d, taken in %.1f us\n", c->id, timestamp, c->balance, c->in_flight, total,
+        (stats_now_ns() - c->started_ns) / 1e3);
+    if (total != s->initial_total) {
+        log_event(s->worker->events_log, stderr, "Process %1d found $%d in snapshot %u instead of $%d\n", s->worker->id, total, c->id, s->initial_total);
+    }
+}
+
+/* Books count ACKs from dst against the transfers this client has in flight */
+static int account_acks(BankClientWorker* s, local_id dst, int count) {
+    if (s->acks_pending[dst] < count) {
+        log_event(s->worker->events_log, stderr, "Process %1d received ACK from %1d without a transfer in flight\n", s->worker->id, dst);
+        return 1;
+    }
+    s->acks_pending[dst] -= count;
+    s->transfers_in_flight -= count;
+    if (s->load != NULL) load_on_ack(s->load, dst, count);
+    return 0;
+}
+
+/* Passes count ACKs from dst for orders of src on to the issuer of src */
+static void hand_acks(IssuerPool* pool, local_id src, local_id dst, int count, lamport_time_t timestamp) {
+    TransferIssuer* issuer = &pool->issuers[pool->owner[src]];
+
+    __atomic_store_n(&issuer->ack_time, timestamp, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&issuer->acks[dst], count, __ATOMIC_RELEASE);
+    // the issuer sees its ACKs before the main thread can find nothing left to wait for
+    __atomic_sub_fetch(&pool->unacked, count, __ATOMIC_SEQ_CST);
+    doorbell_ring(&issuer->acked);
+}
+
+/* Hands an order of bank_robbery() to the issuer of its source, the issuers send them once the robbery is over */
+static int queue_transfer(IssuerPool* pool, TransferOrder order) {
+    TransferIssuer* issuer = &pool->issuers[pool->owner[order.s_src]];
+
+    if (issuer->queued_len == issuer->queued_capacity) {
+        int capacity = (issuer->queued_capacity > 0) ? issuer->queued_capacity * 2 : 64;
+        TransferOrder* queued = realloc(issuer->queued, capacity * sizeof(TransferOrder));
+        if (queued == NULL) return 1;
+        issuer->queued = queued;
+        issuer->queued_capacity = capacity;
+    }
+    issuer->queued[issuer->queued_len++] = order;
+    return 0;
+}
+
+/* Takes the ACKs the main thread has handed this issuer */
+static int take_acks(BankClientWorker* s) {
+    TransferIssuer* issuer = s->issuer;
+
+    for (local_id dst = PARENT_ID + 1; dst < s->worker->nbr_count + 1; dst++) {
+        int acked = __atomic_exchange_n(&issuer->acks[dst], 0, __ATOMIC_ACQUIRE);
+        if (acked != 0 && account_acks(s, dst, acked) != 0) return 1;
+    }
+    // the main thread received the ACKs for us, their times still move our clock on
+    lamport_time_t ack_time = __atomic_load_n(&issuer->ack_time, __ATOMIC_RELAXED);
+    if (ack_time > get_lamport_time_wide()) update_lamport_time(ack_time);
+    return 0;
+}
+
+static int receive_client_message(BankClientWorker* s) {
+    lamport_time_t timestamp;
+    MessageHeader header;
+
+    if (receive_any_header(s->worker, &header) != 0) {
+        log_event(s->worker->events_log, stderr, "Process %1d failed to receive message: %s\n", s->worker->id, strerror(errno));
+        return 1;
+    }
+    update_lamport_time(s->worker->last_time);
+    timestamp = get_lamport_time_wide();
+
+    switch (header.s_type) {
+    case (STARTED): {
+        receive_payload(s->worker, NULL);
+        s->started++;
+        if (s->started == s->worker->nbr_count) {
+            if (s->startup != NULL) s->startup->all_started_ns = stats_now_ns();
+            log_record(s->worker, stdout, (EventRecord) { .s_type = EVENT_RECEIVED_ALL_STARTED, .s_time = timestamp, .s_process = s->worker->id });
+        }
+    } break;
+    case (DONE): {
+        receive_payload(s->worker, NULL);
+    } break;
+    case (ACK): {
+        worker_id dst = s->worker->last_src;
+        int acked = 1;
+        local_id src = PARENT_ID;
+        if (header.s_payload_len == sizeof(TransferAck)) {
+            TransferAck cumulative;
+            receive_payload(s->worker, &cumulative);
+            acked = cumulative.s_count;
+            src = cumulative.s_src;
+        } else {
+            receive_payload(s->worker, NULL);
+        }
+        if (s->pool == NULL) {
+            if (account_acks(s, dst, acked) != 0) return 1;
+        } else if (src > PARENT_ID && src <= s->worker->nbr_count) {
+            hand_acks(s->pool, src, dst, acked, timestamp);
+        } else {
+            log_event(s->worker->events_log, stderr, "Process %1d received ACK from %1d without the source of its transfer\n", s->worker->id, dst);
+            return 1;
+        }
+    } break;
+    case (BALANCE_HISTORY): {
+        if (s->streamed) {
+            char payload[MAX_PAYLOAD_LEN];
+            const HistoryDeltaFrame* frame = (const HistoryDeltaFrame*)payload;
+            AccountHistory* history = &s->long_histories[s->worker->last_src];
+            size_t count = (header.s_payload_len - sizeof(HistoryDeltaFrame)) / sizeof(HistoryDelta);
+
+            receive_payload(s->worker, payload);
+            if (header.s_payload_len < sizeof(HistoryDeltaFrame) || (header.s_payload_len - sizeof(HistoryDeltaFrame)) % sizeof(HistoryDelta) != 0) {
+                log_event(s->worker->events_log, stderr, "Process %1d received a broken history delta frame from %1d\n", s->worker->id, s->worker->last_src);
+                return 1;
+            }
+            for (size_t i = 0; i < count; i++) {
+                if (account_history_apply(history, &frame->s_deltas[i]) != 0) {
+                    log_event(s->worker->events_log, stderr, "Process %1d could not apply a history delta of %1d at time %u\n", s->worker->id, s->worker->last_src, frame->s_deltas[i].s_time);
                     return 1;
                 }
-                log_event(s.worker->events_log, stdout, log_transfer_in_fmt, timestamp, s.worker->id, order.s_amount, order.s_src);
             }
-        } break;
-        case (STOP): {
-            increment_lamport_time();
-            timestamp_t done_time = get_lamport_time();
-            msg = (Message) { .s_header = { .s_magic = MESSAGE_MAGIC, .s_type = DONE, .s_local_time = done_time } };
-            sprintf(msg.s_payload, log_done_fmt, done_time, s.worker->id, s.balance);
-            msg.s_header.s_payload_len = strlen(msg.s_payload);
-            if (send_multicast(s.worker, &msg) != 0) {
-                log_event(s.worker->events_log, stderr, "Process %1d failed to multicast DONE message: %s\n", s.worker->id, strerror(errno));
+            if (!frame->s_last) break;
+        } else if (s->long_histories != NULL) {
+            char payload[MAX_PAYLOAD_LEN];
+            const HistoryChunk* chunk = (const HistoryChunk*)payload;
+            AccountHistory* history = &s->long_histories[s->worker->last_src];
+
+            receive_payload(s->worker, payload);
+            if (header.s_payload_len <= sizeof(HistoryChunk) || account_history_merge_chunk(history, chunk, header.s_payload_len) != 0) {
+                log_event(s->worker->events_log, stderr, "Process %1d received a broken history chunk from %1d\n", s->worker->id, s->worker->last_src);
                 return 1;
             }
-            log_event(s.worker->events_log, stdout, log_done_fmt, done_time, s.worker->id, s.balance);
-        } break;
-        case (DONE): {
-            done++;
-            if (done == s.worker->nbr_count - 1) {
-                log_event(s.worker->events_log, stdout, log_received_all_done_fmt, timestamp, s.worker->id);
+            if (history->len < chunk->s_history_len) break;
+        } else {
+            BalanceHistory* history = &s->history.s_history[s->worker->last_src - 1];
+            size_t states_offset = sizeof(history->s_id) + sizeof(history->s_history_len);
+
+            if (header.s_payload_len < states_offset || header.s_payload_len > sizeof(BalanceHistory)) goto unexpected;
+            // the sender's id is the account id, so the history lands straight in its slot
+            receive_payload(s->worker, history);
+            if (header.s_payload_len != states_offset + history->s_history_len * sizeof(BalanceState)) {
+                log_event(s->worker->events_log, stderr, "Process %1d received a broken balance history from %1d\n", s->worker->id, s->worker->last_src);
+                return 1;
             }
-        } break;
-        default: {
-            log_event(s.worker->events_log, stderr, "Process %1d received unexpected message [%d]\n", s.worker->id, msg.s_header.s_type);
+        }
+        s->done++;
+        if (s->done == s->worker->nbr_count) {
+            log_record(s->worker, stdout, (EventRecord) { .s_type = EVENT_RECEIVED_ALL_DONE, .s_time = timestamp, .s_process = s->worker->id });
+        }
+    } break;
+    case (SNAPSHOT_REPORT): {
+        SnapshotReport report;
+        if (header.s_payload_len != sizeof(report)) goto unexpected;
+        receive_payload(s->worker, &report);
+        int complete = snapshot_on_report(&s->snapshot, s->worker, &report);
+        if (complete < 0) {
+            log_event(s->worker->events_log, stderr, "Process %1d received a report of snapshot %u, which is not running\n", s->worker->id, report.s_id);
             return 1;
-        } break;
         }
+        if (complete) print_snapshot(s, timestamp);
+    } break;
+    default: {
+    unexpected:
+        receive_payload(s->worker, NULL);
+        log_event(s->worker->events_log, stderr, "Process %1d received unexpected message [%d]\n", s->worker->id, header.s_type);
+        return 1;
+    } break;
+    }
+    return 0;
+}
+
+/* Pumps the client's receive loop until at most max_in_flight transfers are waiting for their ACK */
+static int await_transfers(BankClientWorker* s, int max_in_flight) {
+    while (s->transfers_in_flight > max_in_flight) {
+        if (s->issuer == NULL) {
+            if (receive_client_message(s) != 0) return 1;
+            continue;
+        }
+        uint32_t seq = doorbell_seq(&s->issuer->acked);
+        if (take_acks(s) != 0) return 1;
+        if (s->transfers_in_flight > max_in_flight && doorbell_wait(&s->issuer->acked, seq) != 0) return 1;
+    }
+    return 0;
+}
+
+/* Fills the long histories up to the longest one, repeating each account's last balance */
+static int align_long_histories(AccountHistory* histories, worker_id count) {
+    lamport_time_t len = 0;
+    for (worker_id id = PARENT_ID + 1; id <= count; id++) {
+        if (histories[id].len > len) len = histories[id].len;
+    }
+    for (worker_id id = PARENT_ID + 1; id <= count; id++) {
+        AccountHistory* history = &histories[id];
+        if (account_history_record(history, len - 1, history->states[history->len - 1].s_balance) != 0) return -1;
+    }
+    return 0;
+}
+
+/* Extends every history to the latest end time, an account's balance no longer changes once it is DONE */
+static void align_histories(AllHistory* all) {
+    uint8_t history_len = 0;
+    for (int i = 0; i < all->s_history_len; i++) {
+        if (all->s_history[i].s_history_len > history_len) history_len = all->s_history[i].s_history_len;
+    }
+    for (int i = 0; i < all->s_history_len; i++) {
+        BalanceHistory* history = &all->s_history[i];
+        for (int t = history->s_history_len; t < history_len; t++) {
+            history->s_history[t] = (BalanceState) { .s_balance = history->s_history[t - 1].s_balance, .s_time = t, .s_balance_pending_in = 0 };
+        }
+        history->s_history_len = history_len;
+    }
+}
+
+/* Checks that the money in the histories adds up at every time, returns 1 if it does not.
+ * Long histories are checked in place, they have been aligned by now. */
+static int audit_history(BankClientWorker* s) {
+    AuditResult audit;
+    int violated;
+    int64_t started_ns = stats_now_ns();
+    if (s->long_histories != NULL) {
+        const BalanceState* states[MAX_PROCESS_ID];
+        for (worker_id id = PARENT_ID + 1; id < s->worker->nbr_count + 1; id++) states[id - 1] = s->long_histories[id].states;
+        violated = audit_histories(states, s->worker->nbr_count, s->long_histories[PARENT_ID + 1].len, s->initial_total, &audit);
+    } else {
+        violated = audit_all_history(&s->history, s->initial_total, &audit);
     }
+    double audit_us = (stats_now_ns() - started_ns) / 1e3;
+
+    if (violated) {
+        printf("audit: total $%d instead of $%d at t=%u, checked in %.1f us\n", audit.total, s->initial_total, audit.first_violation, audit_us);
+        return 1;
+    }
+    printf("audit: total $%d at all %u times of %d accounts, checked in %.1f us\n", s->initial_total, audit.len, s->worker->nbr_count, audit_us);
+    return 0;
+}
 
-    timestamp = get_lamport_time();
-    update_balance_history(&s, s.history.s_history_len, timestamp, s.balance);
+/* Sends the orders buffered for src as one TRANSFER frame */
+static int flush_transfers(BankClientWorker* s, local_id src) {
+    MessageHeader header;
+
+    if (s->batch_lens[src] == 0) return 0;
 
     increment_lamport_time();
-    timestamp_t history_time = get_lamport_time();
-    size_t payload_len = sizeof(s.history.s_id) + sizeof(s.history.s_history_len) + s.history.s_history_len * sizeof(BalanceState);
-    msg = (Message) { .s_header = { .s_magic = MESSAGE_MAGIC, .s_type = BALANCE_HISTORY, .s_local_time = history_time, .s_payload_len = payload_len } };
-    memcpy(msg.s_payload, &s.history, payload_len);
-    if (send(s.worker, PARENT_ID, &msg) != 0) {
-        log_event(s.worker->events_log, stderr, "Process %1d failed to send BALANCE_HISTORY message to %1d: %s\n", s.worker->id, PARENT_ID, strerror(errno));
+    lamport_time_t timestamp = get_lamport_time_wide();
+    header = (MessageHeader) { .s_magic = MESSAGE_MAGIC, .s_type = TRANSFER, .s_local_time = timestamp, .s_payload_len = s->batch_lens[src] * sizeof(TransferOrder) };
+    if (send_iov(s->worker, src, &header, s->batches[src]) != 0) {
+        log_event(s->worker->events_log, stderr, "Process %1d failed to send TRANSFER message to %1d: %s\n", s->worker->id, src, strerror(errno));
         return 1;
     }
+    if (s->issuer != NULL) {
+        // counted once they are out, so the main thread only receives while an ACK is sure to come.
+        // Their ACKs may be handed over first, unacked is then below 0 until this catches up.
+        __atomic_add_fetch(&s->pool->unacked, s->batch_lens[src], __ATOMIC_SEQ_CST);
+        doorbell_ring(&s->pool->bell);
+    }
+    if (s->startup != NULL && s->startup->first_transfer_ns == 0) s->startup->first_transfer_ns = stats_now_ns();
+    s->batch_lens[src] = 0;
     return 0;
 }
 
-int execute_bank_client_worker(BankClientWorker s) {
-    timestamp_t timestamp;
-    Message msg;
-    size_t started = 0;
-    size_t done = 0;
+static int flush_all_transfers(BankClientWorker* s) {
+    for (local_id src = PARENT_ID + 1; src < s->worker->nbr_count + 1; src++) {
+        if (flush_transfers(s, src) != 0) return 1;
+    }
+    return 0;
+}
 
-    while (started != s.worker->nbr_count || done != s.worker->nbr_count) {
-        if (receive_any(s.worker, &msg) != 0) {
-            log_event(s.worker->events_log, stderr, "Process %1d failed to receive message: %s\n", s.worker->id, strerror(errno));
+static void* transfer_issuer_thread(void* arg) {
+    TransferIssuer* issuer = arg;
+    BankClientWorker* s = &issuer->client;
+
+    stats_attach(&issuer->stats);
+    update_lamport_time(issuer->ack_time);
+    if (s->load != NULL) {
+        load_run(s->load, s);
+    } else {
+        for (int i = 0; i < issuer->queued_len; i++) transfer(s, issuer->queued[i].s_src, issuer->queued[i].s_dst, issuer->queued[i].s_amount);
+    }
+    issuer->status = (s->failed || flush_all_transfers(s) != 0) ? 1 : 0;
+    // the main thread stops once every issuer is through and unacked is back to 0
+    __atomic_add_fetch(&s->pool->finished, 1, __ATOMIC_SEQ_CST);
+    doorbell_ring(&s->pool->bell);
+    if (issuer->status == 0) issuer->status = await_transfers(s, 0);
+    issuer->end_time = get_lamport_time_wide();
+    return NULL;
+}
+
+/* Starts the --issuers threads and receives for them until every order they sent is acknowledged */
+static int run_issuers(BankClientWorker* s) {
+    IssuerPool* pool = s->pool;
+    int started = 0;
+    int status = 0;
+
+    // bank_robbery() runs once, its orders are split up by source
+    if (s->load == NULL) {
+        s->robbery(s, s->worker->nbr_count);
+        if (s->failed) return 1;
+    }
+
+    for (; started < pool->count; started++) {
+        TransferIssuer* issuer = &pool->issuers[started];
+        issuer->ack_time = get_lamport_time_wide();
+        int error = pthread_create(&issuer->thread, NULL, transfer_issuer_thread, issuer);
+        if (error != 0) {
+            log_event(s->worker->events_log, stderr, "Process %1d failed to start transfer issuer %d: %s\n", s->worker->id, started, strerror(error));
+            status = 1;
+            break;
+        }
+    }
+
+    // an ACK is only waited for while one is due, issuers ring the bell when they send or finish.
+    // finished is read first: once every issuer is through, unacked has all of their orders in it
+    while (1) {
+        uint32_t seq = doorbell_seq(&pool->bell);
+        bool finished = __atomic_load_n(&pool->finished, __ATOMIC_SEQ_CST) == started;
+        int unacked = __atomic_load_n(&pool->unacked, __ATOMIC_SEQ_CST);
+        if (finished && unacked == 0) break;
+        if (unacked > 0) {
+            if (receive_client_message(s) != 0) return 1;
+        } else if (doorbell_wait(&pool->bell, seq) != 0) {
             return 1;
         }
-        update_lamport_time(msg.s_header.s_local_time);
-        timestamp = get_lamport_time();
+    }
+
+    for (int i = 0; i < started; i++) {
+        TransferIssuer* issuer = &pool->issuers[i];
+        pthread_join(issuer->thread, NULL);
+        if (issuer->status != 0) status = issuer->status;
+        // STOP has to come after every transfer of every issuer
+        if (issuer->end_time > get_lamport_time_wide()) update_lamport_time(issuer->end_time);
+        stats_merge(process_stats, &issuer->stats);
+        if (s->load != NULL) load_merge(s->load, &issuer->load);
+    }
+    return status;
+}
 
-        switch (msg.s_header.s_type) {
-        case (STARTED): {
-            started++;
-            if (started == s.worker->nbr_count) {
-                log_event(s.worker->events_log, stdout, log_received_all_started_fmt, timestamp, s.worker->id);
+int execute_bank_client_worker(BankClientWorker s) {
+    MessageHeader header;
 
-                bank_robbery(&s, s.worker->nbr_count);
+    while (s.started != s.worker->nbr_count) {
+        if (receive_client_message(&s) != 0) return 1;
+    }
 
-                increment_lamport_time();
-                timestamp_t stop_time = get_lamport_time();
-                msg = (Message) { .s_header = { .s_magic = MESSAGE_MAGIC, .s_type = STOP, .s_local_time = stop_time } };
-                if (send_multicast(s.worker, &msg) != 0) {
-                    log_event(s.worker->events_log, stderr, "Process %1d failed to multicast STOP message: %s\n", s.worker->id, strerror(errno));
-                    return 1;
-                }
-            }
-        } break;
-        case (DONE): {
-        } break;
-        case (BALANCE_HISTORY): {
-            BalanceHistory history = *(BalanceHistory*)msg.s_payload;
-            s.history.s_history[history.s_id - 1] = history;
-            done++;
-            if (done == s.worker->nbr_count) {
-                log_event(s.worker->events_log, stdout, log_received_all_done_fmt, timestamp, s.worker->id);
-            }
-        } break;
-        default: {
-            log_event(s.worker->events_log, stderr, "Process %1d received unexpected message [%d]\n", s.worker->id, msg.s_header.s_type);
+    if (s.pool != NULL) {
+        if (run_issuers(&s) != 0) return 1;
+    } else {
+        if (s.load != NULL) {
+            load_run(s.load, &s);
+        } else {
+            s.robbery(&s, s.worker->nbr_count);
+        }
+        if (s.failed) return 1;
+        if (flush_all_transfers(&s) != 0) return 1;
+        if (await_transfers(&s, 0) != 0) return 1;
+    }
+    // markers must not outlive STOP, accounts leave once they are DONE
+    while (s.snapshot.running) {
+        if (receive_client_message(&s) != 0) return 1;
+    }
+
+    increment_lamport_time();
+    lamport_time_t stop_time = get_lamport_time_wide();
+    header = (MessageHeader) { .s_magic = MESSAGE_MAGIC, .s_type = STOP, .s_local_time = stop_time };
+    if (send_multicast_iov(s.worker, &header, NULL) != 0) {
+        log_event(s.worker->events_log, stderr, "Process %1d failed to multicast STOP message: %s\n", s.worker->id, strerror(errno));
+        return 1;
+    }
+
+    while (s.done != s.worker->nbr_count) {
+        if (receive_client_message(&s) != 0) return 1;
+    }
+
+    if (s.long_histories != NULL) {
+        // print_history() only takes MAX_T entries per account
+        if (align_long_histories(s.long_histories, s.worker->nbr_count) != 0) {
+            log_event(s.worker->events_log, stderr, "Process %1d failed to grow balance histories\n", s.worker->id);
             return 1;
-        } break;
         }
     }
+    if (s.streamed && !s.worker->wide_clock) {
+        // without --long-run the replayed histories stop short of MAX_T like the ones sent whole
+        for (worker_id id = PARENT_ID + 1; id < s.worker->nbr_count + 1; id++) account_history_export(&s.long_histories[id], &s.history.s_history[id - 1]);
+    } else if (s.long_histories != NULL) {
+        account_histories_print(s.long_histories + PARENT_ID + 1, s.worker->nbr_count, stdout);
+        if (s.load != NULL) load_report(s.load, NULL, stdout);
+        return s.audit ? audit_history(&s) : 0;
+    }
 
+    align_histories(&s.history);
     print_history(&s.history);
+    if (s.load != NULL) load_report(s.load, &s.history, stdout);
+    if (s.audit) return audit_history(&s);
     return 0;
 }
 
 void transfer(void* parent_data, local_id src, local_id dst, balance_t amount) {
     BankClientWorker* s = (BankClientWorker*)parent_data;
-    timestamp_t timestamp;
-    Message msg;
+    int64_t issued_at = stats_now_ns();
 
+    // the first error stops every transfer after it
+    if (s->failed) return;
     TransferOrder order = { .s_src = src, .s_dst = dst, .s_amount = amount };
 
-    increment_lamport_time();
-    timestamp = get_lamport_time();
-    msg = (Message) { .s_header = { .s_magic = MESSAGE_MAGIC, .s_type = TRANSFER, .s_local_time = timestamp, .s_payload_len = sizeof(order) } };
-    memcpy(msg.s_payload, &order, msg.s_header.s_payload_len);
-    if (send(s->worker, src, &msg) != 0) {
-        log_event(s->worker->events_log, stderr, "Process %1d failed to send TRANSFER message to %1d: %s\n", s->worker->id, src, strerror(errno));
+    if (s->pool != NULL && s->issuer == NULL) {
+        if (queue_transfer(s->pool, order) != 0) {
+            log_event(s->worker->events_log, stderr, "Process %1d failed to queue a transfer from %1d\n", s->worker->id, src);
+            s->failed = true;
+        }
         return;
     }
-
-    if (receive(s->worker, dst, &msg) != 0) {
-        log_event(s->worker->events_log, stderr, "Process %1d failed to receive message from %1d: %s\n", s->worker->id, dst, strerror(errno));
+    if (s->issuer != NULL && take_acks(s) != 0) {
+        s->failed = true;
         return;
     }
-    update_lamport_time(msg.s_header.s_local_time);
 
-    if (msg.s_header.s_type != ACK) {
-        log_event(s->worker->events_log, stderr, "Process %1d expected to receive ACK message from %1d, but got [%d]\n", s->worker->id, dst, msg.s_header.s_type);
+    s->batches[src][s->batch_lens[src]++] = order;
+    s->acks_pending[dst]++;
+    s->transfers_in_flight++;
+
+    if (s->batch_lens[src] == s->batch_size && flush_transfers(s, src) != 0) {
+        s->failed = true;
         return;
     }
+    // one snapshot at a time, an audit due while one runs is skipped
+    s->transfers_issued++;
+    if (s->snapshot_every > 0 && s->transfers_issued % s->snapshot_every == 0 && !s->snapshot.running) {
+        if (snapshot_start(&s->snapshot, s->worker) != 0) {
+            log_event(s->worker->events_log, stderr, "Process %1d failed to multicast snapshot marker: %s\n", s->worker->id, strerror(errno));
+            s->failed = true;
+            return;
+        }
+    }
+    if (s->transfers_in_flight >= s->transfer_window) {
+        // orders still sitting in a batch would never be acknowledged, so the window can only drain once they are out
+        if (flush_all_transfers(s) != 0) {
+            s->failed = true;
+            return;
+        }
+
+        // orders to one src share a FIFO channel, so src still applies them in the order they were issued
+        if (await_transfers(s, s->transfer_window - 1) != 0) {
+            log_event(s->worker->events_log, stderr, "Process %1d stopped waiting for ACKs of its transfers\n", s->worker->id);
+            s->failed = true;
+            return;
+        }
+    }
+    histogram_record(&process_stats->transfer_round_trip, stats_now_ns() - issued_at);
 }
 
+static const char* const usage_fmt = "usage: %s [--window N] [--batch N] [--transport pipe|shm] [--topology mesh|lazy] [--event-log text|binary] [--load N [--seed S] [--distribution uniform|zipf|ring]] [--stats] [--long-run] [--threads] [--fast-start] [--startup-timing] [--pin] [--busy-poll] [--mutexl] [--snapshot-every N] [--stream-history] [--audit] [--record-trace] [--scenario SO] [--rx-priority] [--issuers N] -p X <B1..BX>\n"
+                                     "       %s --replay-trace FILE [--paced]\n"
+                                     "--issuers N: N threads issue the transfers, each from a block of source accounts of its own.\n"
+                                     "             With --load every transfer stays inside its block, which needs two accounts.\n";
+
 typedef struct {
     bool ok;
     int bank_account_workers_count; // number of bank account processes
     balance_t initial_balances[MAX_PROCESS_ID + 1]; // initial account balances
+    int transfer_window; // transfers the client keeps in flight before waiting for an ACK
+    int batch_size; // transfer orders packed into one frame per source account
+    Transport transport; // how messages travel between processes
+    Topology topology; // which pipe channels exist before fork()
+    EventLogFormat event_log_format; // where event lines are logged
+    int load_transfers; // transfers issued by the load generator, 0 runs bank_robbery()
+    const char* scenario; // shared object to take bank_robbery() from instead of the one linked in
+    bool rx_priority; // receive_any serves ACK and CS_REPLY ahead of their turn
+    int issuers; // threads of the parent issuing transfers, 0 issues them from the main thread
+    uint64_t load_seed;
+    LoadDistribution load_distribution;
+    bool stats; // print per-process IPC counters and histograms to stderr at exit
+    bool long_run; // 32-bit Lamport times on the wire and histories of any length
+    bool threads; // accounts run as threads of this process instead of forked children
+    bool fast_start; // fork as a tree, close unused descriptors in bulk and keep pipes.log buffered across fork()
+    bool startup_timing; // print how long each startup phase took to stderr
+    bool pin; // pin every process to a CPU of its own while there are enough of them
+    bool busy_poll; // spin instead of sleeping while waiting for a ring
+    bool mutexl; // accounts also take turns printing under a distributed critical section
+    int snapshot_every; // transfers between two snapshots of the total balance, 0 takes none
+    bool stream_history; // accounts send history deltas while they run instead of the whole history at the end
+    bool audit; // check the printed history for conservation of money
+    bool record_trace; // every process writes the messages it sends and receives to trace.<id>.bin
+    const char* replay_trace; // runs the account of this trace on its recorded messages instead of a bank
+    bool replay_paced; // the replay waits as long between messages as the recorded run did
 } CliArgs;
 
 CliArgs arg_parse(int argc, char** argv) {
-    CliArgs args = { .ok = false };
+    CliArgs args = { .ok = false, .transfer_window = 0, .batch_size = 1, .transport = TRANSPORT_PIPE, .topology = TOPOLOGY_MESH, .event_log_format = EVENT_LOG_TEXT, .load_seed = 1, .load_distribution = LOAD_UNIFORM };
+    bool transport_given = false;
+    int opt = 1;
 
-    if (argc < 3) {
-        fprintf(stderr, "usage: %s -p X <B1..BX>\n", argv[0]);
+    for (; opt < argc && strcmp(argv[opt], "-p") != 0; opt++) {
+        if (strcmp(argv[opt], "--window") == 0 && opt + 1 < argc) {
+            args.transfer_window = atoi(argv[++opt]);
+            if (args.transfer_window <= 0) {
+                fprintf(stderr, "error: Transfer window must be a positive integer\n");
+                return args;
+            }
+        } else if (strcmp(argv[opt], "--batch") == 0 && opt + 1 < argc) {
+            args.batch_size = atoi(argv[++opt]);
+            if (args.batch_size <= 0 || args.batch_size > MAX_TRANSFER_BATCH) {
+                fprintf(stderr, "error: Batch size must be an integer in [1;%d]\n", MAX_TRANSFER_BATCH);
+                return args;
+            }
+        } else if (strcmp(argv[opt], "--transport") == 0 && opt + 1 < argc) {
+            opt++;
+            transport_given = true;
+            if (strcmp(argv[opt], "pipe") == 0) {
+                args.transport = TRANSPORT_PIPE;
+            } else if (strcmp(argv[opt], "shm") == 0) {
+                args.transport = TRANSPORT_SHM;
+            } else {
+                fprintf(stderr, "error: Unknown transport %s\n", argv[opt]);
+                return args;
+            }
+        } else if (strcmp(argv[opt], "--topology") == 0 && opt + 1 < argc) {
+            opt++;
+            if (strcmp(argv[opt], "mesh") == 0) {
+                args.topology = TOPOLOGY_MESH;
+            } else if (strcmp(argv[opt], "lazy") == 0) {
+                args.topology = TOPOLOGY_LAZY;
+            } else {
+                fprintf(stderr, "error: Unknown topology %s\n", argv[opt]);
+                return args;
+            }
+        } else if (strcmp(argv[opt], "--load") == 0 && opt + 1 < argc) {
+            args.load_transfers = atoi(argv[++opt]);
+            if (args.load_transfers <= 0) {
+                fprintf(stderr, "error: Load must be a positive number of transfers\n");
+                return args;
+            }
+        } else if (strcmp(argv[opt], "--seed") == 0 && opt + 1 < argc) {
+            args.load_seed = strtoull(argv[++opt], NULL, 10);
+        } else if (strcmp(argv[opt], "--distribution") == 0 && opt + 1 < argc) {
+            opt++;
+            if (strcmp(argv[opt], "uniform") == 0) {
+                args.load_distribution = LOAD_UNIFORM;
+            } else if (strcmp(argv[opt], "zipf") == 0) {
+                args.load_distribution = LOAD_ZIPF;
+            } else if (strcmp(argv[opt], "ring") == 0) {
+                args.load_distribution = LOAD_RING;
+            } else {
+                fprintf(stderr, "error: Unknown distribution %s\n", argv[opt]);
+                return args;
+            }
+        } else if (strcmp(argv[opt], "--stats") == 0) {
+            args.stats = true;
+        } else if (strcmp(argv[opt], "--long-run") == 0) {
+            args.long_run = true;
+        } else if (strcmp(argv[opt], "--threads") == 0) {
+            args.threads = true;
+        } else if (strcmp(argv[opt], "--fast-start") == 0) {
+            args.fast_start = true;
+        } else if (strcmp(argv[opt], "--startup-timing") == 0) {
+            args.startup_timing = true;
+        } else if (strcmp(argv[opt], "--pin") == 0) {
+            args.pin = true;
+        } else if (strcmp(argv[opt], "--busy-poll") == 0) {
+            args.busy_poll = true;
+        } else if (strcmp(argv[opt], "--mutexl") == 0) {
+            args.mutexl = true;
+        } else if (strcmp(argv[opt], "--audit") == 0) {
+            args.audit = true;
+        } else if (strcmp(argv[opt], "--stream-history") == 0) {
+            args.stream_history = true;
+        } else if (strcmp(argv[opt], "--rx-priority") == 0) {
+            args.rx_priority = true;
+        } else if (strcmp(argv[opt], "--issuers") == 0 && opt + 1 < argc) {
+            args.issuers = atoi(argv[++opt]);
+            if (args.issuers <= 0) {
+                fprintf(stderr, "error: Number of issuers must be a positive integer\n");
+                return args;
+            }
+        } else if (strcmp(argv[opt], "--scenario") == 0 && opt + 1 < argc) {
+            args.scenario = argv[++opt];
+        } else if (strcmp(argv[opt], "--record-trace") == 0) {
+            args.record_trace = true;
+        } else if (strcmp(argv[opt], "--replay-trace") == 0 && opt + 1 < argc) {
+            args.replay_trace = argv[++opt];
+        } else if (strcmp(argv[opt], "--paced") == 0) {
+            args.replay_paced = true;
+        } else if (strcmp(argv[opt], "--snapshot-every") == 0 && opt + 1 < argc) {
+            args.snapshot_every = atoi(argv[++opt]);
+            if (args.snapshot_every <= 0) {
+                fprintf(stderr, "error: Snapshot interval must be a positive number of transfers\n");
+                return args;
+            }
+        } else if (strcmp(argv[opt], "--event-log") == 0 && opt + 1 < argc) {
+            opt++;
+            if (strcmp(argv[opt], "text") == 0) {
+                args.event_log_format = EVENT_LOG_TEXT;
+            } else if (strcmp(argv[opt], "binary") == 0) {
+                args.event_log_format = EVENT_LOG_BINARY;
+            } else {
+                fprintf(stderr, "error: Unknown event log format %s\n", argv[opt]);
+                return args;
+            }
+        } else {
+            fprintf(stderr, usage_fmt, argv[0], argv[0]);
+            return args;
+        }
+    }
+    if (args.replay_paced && args.replay_trace == NULL) {
+        fprintf(stderr, "error: Pacing needs --replay-trace\n");
+        return args;
+    }
+    // a replay takes everything else from the trace
+    if (args.replay_trace != NULL) {
+        args.ok = (opt == argc);
+        if (!args.ok) fprintf(stderr, usage_fmt, argv[0], argv[0]);
+        return args;
+    }
+    // the requests and replies of the critical section carry Lamport time past the MAX_T of a classic history
+    if (args.mutexl) args.long_run = true;
+    // the shm rings are lock-free single-producer mailboxes, which is all threads of one process need
+    if (args.threads) {
+        if (args.topology == TOPOLOGY_LAZY || (transport_given && args.transport != TRANSPORT_SHM)) {
+            fprintf(stderr, "error: Threads need the shm transport and the mesh topology\n");
+            return args;
+        }
+        args.transport = TRANSPORT_SHM;
+    }
+    if (args.topology == TOPOLOGY_LAZY && args.transport != TRANSPORT_PIPE) {
+        fprintf(stderr, "error: Lazy topology needs the pipe transport\n");
         return args;
     }
+    if (args.busy_poll && args.transport != TRANSPORT_SHM) {
+        fprintf(stderr, "error: Busy polling needs the shm transport\n");
+        return args;
+    }
+    // snapshots are started by whoever issues the transfers, a trace has a single writer
+    if (args.issuers > 0 && (args.snapshot_every > 0 || args.record_trace)) {
+        fprintf(stderr, "error: Issuers cannot be combined with --snapshot-every or --record-trace\n");
+        return args;
+    }
+    // a batch only fills up while the window has room for it
+    if (args.transfer_window == 0) args.transfer_window = args.batch_size;
 
-    if (strcmp(argv[1], "-p") != 0) {
-        fprintf(stderr, "usage: %s -p X <B1..BX>\n", argv[0]);
+    if (argc - opt < 2) {
+        fprintf(stderr, usage_fmt, argv[0], argv[0]);
         return args;
     }
 
-    args.bank_account_workers_count = atoi(argv[2]);
+    args.bank_account_workers_count = atoi(argv[opt + 1]);
     if (args.bank_account_workers_count <= 0) {
         fprintf(stderr, "error: Number of processes must be a positive integer\n");
         return args;
     }
 
-    if (argc != 3 + args.bank_account_workers_count) {
+    if (argc != opt + 2 + args.bank_account_workers_count) {
         fprintf(stderr, "error: Process and balances number mismatch\n");
         return args;
     }
     for (int i = PARENT_ID + 1; i <= args.bank_account_workers_count; i++) {
-        args.initial_balances[i] = atoi(argv[3 + i - 1]);
+        args.initial_balances[i] = atoi(argv[opt + 2 + i - 1]);
         if (args.initial_balances[i] <= 0) {
             fprintf(stderr, "error: Balance must be a positive integer\n");
             return args;
         }
     }
+    // each issuer owns a block of source accounts, the load generator needs two accounts in a block
+    if (args.issuers * (args.load_transfers > 0 ? 2 : 1) > args.bank_account_workers_count) {
+        fprintf(stderr, "error: Every issuer needs %s of its own\n", (args.load_transfers > 0) ? "two accounts" : "an account");
+        return args;
+    }
 
     args.ok = true;
     return args;
 }
 
+/* Resolves bank_robbery() from a scenario built by build_scenario.sh, the object stays loaded until handle is closed */
+static BankRobbery load_scenario(const char* path, void** handle) {
+    BankRobbery robbery;
+
+    *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (*handle == NULL) {
+        fprintf(stderr, "Failed to load scenario %s: %s\n", path, dlerror());
+        return NULL;
+    }
+    // ISO C cannot convert a void* to a function pointer, POSIX makes their representations the same
+    *(void**)&robbery = dlsym(*handle, "bank_robbery");
+    if (robbery == NULL) {
+        fprintf(stderr, "Failed to find bank_robbery in scenario %s: %s\n", path, dlerror());
+        dlclose(*handle);
+        *handle = NULL;
+    }
+    return robbery;
+}
+
+/* Prints the startup phases of the run, each one ending at a milestone */
+static void print_startup_times(const StartupTimes* t, const ProcessStats* all, int count, FILE* out) {
+    int64_t all_ready_ns = 0;
+    for (int id = 0; id < count; id++) {
+        if (all[id].ready_ns > all_ready_ns) all_ready_ns = all[id].ready_ns;
+    }
+
+    const char* phases[] = { "setup", "channels", "spawn", "channel cleanup", "STARTED exchange", "first transfer" };
+    int64_t ends[] = { t->setup_ns, t->channels_ns, t->spawned_ns, all_ready_ns, t->all_started_ns, t->first_transfer_ns };
+    int64_t previous = t->main_ns;
+
+    fprintf(out, "%-18s | %10s | %14s\n", "startup phase", "ms", "since main() ms");
+    for (size_t i = 0; i < sizeof(phases) / sizeof(phases[0]); i++) {
+        // a run without transfers has no first one, threads can be ready before the last one is started
+        if (ends[i] == 0) continue;
+        int64_t end = (ends[i] > previous) ? ends[i] : previous;
+        fprintf(out, "%-18s | %10.3f | %14.3f\n", phases[i], (end - previous) / 1e6, (end - t->main_ns) / 1e6);
+        previous = end;
+    }
+}
+
+/* Prints where each process ended up under --pin */
+static void print_cpu_placement(const ProcessStats* all, int count, int cpu_count, FILE* out) {
+    fprintf(out, "%d processes pinned to %d CPUs%s\n", count, cpu_count, (count > cpu_count) ? ", some of them share one" : "");
+    fprintf(out, "%4s | %4s\n", "proc", "cpu");
+    for (int id = 0; id < count; id++) fprintf(out, "%4d | %4d\n", id, all[id].cpu);
+}
+
 int main(int argc, char** argv) {
+    StartupTimes startup = { .main_ns = stats_now_ns() };
     int result = 0;
     Worker* workers = NULL;
     Worker* w;
+    BinaryEventLog* events_bin = NULL;
+    ProcessStats* stats = NULL;
+    BankAccountThread threads[MAX_PROCESS_ID + 1];
+    worker_id threads_started = 0;
+    int cpus[MAX_PROCESS_ID + 1];
+    int cpu_count = 0;
+    IssuerPool pool = { .count = 0 };
+    BankRobbery robbery = bank_robbery;
+    void* scenario = NULL;
 
     CliArgs args = arg_parse(argc, argv);
     if (!args.ok) return 1;
+    if (args.replay_trace != NULL) return replay_bank_account(args.replay_trace, args.replay_paced);
+    // loaded before fork(), so a broken scenario never gets the accounts started
+    if (args.scenario != NULL) {
+        robbery = load_scenario(args.scenario, &scenario);
+        if (robbery == NULL) return 1;
+    }
+    if (robbery == NULL && args.load_transfers == 0) {
+        fprintf(stderr, "error: pa2 was built without bank_robbery.c, pass --scenario or --load\n");
+        return 1;
+    }
+    // without --long-run histories go out as one BalanceHistory
+    lamport_time_t history_max_time = args.long_run ? UINT32_MAX : MAX_T;
+    AccountOptions account_options = {
+        .history_max_time = history_max_time,
+        .mutexl = args.mutexl,
+        .stream_history = args.stream_history,
+        .record_trace = args.record_trace,
+        .wide_clock = args.long_run,
+        .ack_source = args.issuers > 0,
+    };
 
-    FILE* pipes_log_fd = fopen(pipes_log, "a");
+    Logger* pipes_log_fd = logger_open(pipes_log);
     if (pipes_log_fd == NULL) {
         fprintf(stderr, "Failed to open file %s: %s", pipes_log, strerror(errno));
         return 1;
     }
 
-    FILE* events_log_fd = fopen(events_log, "a");
+    Logger* events_log_fd = logger_open(events_log);
     if (events_log_fd == NULL) {
         fprintf(stderr, "Failed to open file %s: %s", events_log, strerror(errno));
         return 1;
     }
 
+    if (args.event_log_format == EVENT_LOG_BINARY) {
+        events_bin = event_log_open(events_bin_log);
+        if (events_bin == NULL) {
+            fprintf(stderr, "Failed to open file %s: %s", events_bin_log, strerror(errno));
+            defer_return(1);
+        }
+    }
+
+    // threads share the counters of this process, so each one needs a slot even without --stats
+    if (args.stats || args.threads || args.startup_timing || args.pin || args.mutexl) {
+        stats = stats_map_shared(args.bank_account_workers_count + 1);
+        if (stats == NULL) {
+            fprintf(stderr, "Failed to map shared stats: %s\n", strerror(errno));
+            defer_return(1);
+        }
+    }
+
+    // planned before anyone is pinned, children would only see the CPU of their parent otherwise
+    if (args.pin) {
+        cpu_count = cpu_plan(cpus, args.bank_account_workers_count + 1);
+        if (cpu_count < 0) {
+            fprintf(stderr, "Failed to get the CPUs to pin to: %s\n", strerror(errno));
+            defer_return(1);
+        }
+    }
+
+    startup.setup_ns = stats_now_ns();
+
     workers = calloc(args.bank_account_workers_count + 1, sizeof(Worker));
-    if (init_workers(workers, args.bank_account_workers_count, events_log_fd, pipes_log_fd) != 0) defer_return(1);
-    fflush(pipes_log_fd); // flush to avoid writing the same buffer again from workers
+    if (init_workers(workers, args.bank_account_workers_count, args.transport, args.topology, events_log_fd, pipes_log_fd) != 0) defer_return(1);
+    for (worker_id worker_id = PARENT_ID; worker_id < args.bank_account_workers_count + 1; worker_id++) {
+        workers[worker_id].events_bin = events_bin;
+        workers[worker_id].wide_clock = args.long_run;
+        workers[worker_id].busy_poll = args.busy_poll;
+        workers[worker_id].rx_priority = args.rx_priority ? RX_PRIORITY_TYPES : 0;
+    }
+    startup.channels_ns = stats_now_ns();
+    // flush to avoid writing the same buffer again from workers, --fast-start has them drop their copy instead
+    if (!args.fast_start) {
+        logger_flush(pipes_log_fd);
+        logger_flush(events_log_fd);
+    }
+    int (*deinit_channels)(Worker*, Worker*, Logger*) = args.fast_start ? deinit_unused_channels_bulk : deinit_unused_channels;
 
-    for (worker_id worker_id = PARENT_ID + 1; worker_id < args.bank_account_workers_count + 1; worker_id++) {
-        int worker_pid = fork();
-        switch (worker_pid) {
-        case -1: {
-            fprintf(stderr, "Failed to fork a new process for worker %d: %s\n", worker_id, strerror(errno));
+    for (worker_id worker_id = PARENT_ID + 1; worker_id < args.bank_account_workers_count + 1 && args.threads; worker_id++) {
+        BankAccountThread* t = &threads[worker_id];
+        *t = (BankAccountThread) { .worker = &workers[worker_id], .balance = args.initial_balances[worker_id], .options = &account_options, .stats = &stats[worker_id] };
+        if (args.pin) t->cpu_plan = cpus;
+
+        // a Logger buffer belongs to one writer, the file is opened for appending so lines of different threads do not clobber each other
+        t->worker->events_log = logger_open(events_log);
+        if (t->worker->events_log == NULL) {
+            fprintf(stderr, "Failed to open file %s for worker %d: %s\n", events_log, worker_id, strerror(errno));
+            defer_return(1);
+        }
+        int error = pthread_create(&t->thread, NULL, bank_account_thread, t);
+        if (error != 0) {
+            fprintf(stderr, "Failed to start a thread for worker %d: %s\n", worker_id, strerror(error));
+            logger_close(t->worker->events_log);
             defer_return(2);
-        } break;
-        case 0: {
-            w = &workers[worker_id];
-            BankAccountWorker bank_account_worker = {
-                .worker = w,
-                .balance = args.initial_balances[worker_id],
-                .history = {
-                    .s_id = worker_id,
-                    .s_history_len = 1,
-                    .s_history = { [0] = { .s_time = 0, .s_balance = args.initial_balances[worker_id], .s_balance_pending_in = 0 } },
-                },
-                .received_count = 0,
-            };
-            deinit_unused_channels(w, workers, pipes_log_fd);
-
-            int status = execute_bank_account_worker(bank_account_worker);
-            defer_return(status);
-        } break;
         }
+        threads_started = worker_id;
+    }
+
+    worker_id self = PARENT_ID;
+    if (args.threads) {
+        // accounts are running already
+    } else if (args.fast_start) {
+        self = spawn_workers_tree(PARENT_ID + 1, args.bank_account_workers_count);
+        if (self == -1) defer_return(2);
+    } else {
+        for (worker_id worker_id = PARENT_ID + 1; worker_id < args.bank_account_workers_count + 1 && self == PARENT_ID; worker_id++) {
+            int worker_pid = fork();
+            if (worker_pid == -1) {
+                fprintf(stderr, "Failed to fork a new process for worker %d: %s\n", worker_id, strerror(errno));
+                defer_return(2);
+            }
+            if (worker_pid == 0) self = worker_id;
+        }
+    }
+
+    if (self != PARENT_ID) {
+        w = &workers[self];
+        // lines buffered before fork() are the parent's to write
+        logger_discard(pipes_log_fd);
+        logger_discard(events_log_fd);
+        if (stats != NULL) stats_attach(&stats[self]);
+        if (pin_worker(args.pin ? cpus : NULL, self) != 0) defer_return(1);
+        if (deinit_channels(w, workers, pipes_log_fd) != 0) defer_return(1);
+        process_stats->ready_ns = stats_now_ns();
+
+        defer_return(run_bank_account(w, args.initial_balances[self], &account_options));
     }
+    startup.spawned_ns = stats_now_ns();
 
     w = &workers[PARENT_ID];
-    BankClientWorker bank_client_worker = { .worker = w, .history = { .s_history_len = args.bank_account_workers_count } };
-    deinit_unused_channels(bank_client_worker.worker, workers, pipes_log_fd);
+    if (stats != NULL) stats_attach(&stats[PARENT_ID]);
+    if (pin_worker(args.pin ? cpus : NULL, PARENT_ID) != 0) defer_return(1);
+    BankClientWorker bank_client_worker = {
+        .worker = w,
+        .history = { .s_history_len = args.bank_account_workers_count },
+        .transfer_window = args.transfer_window,
+        .batch_size = args.batch_size,
+        .robbery = robbery,
+        .startup = args.startup_timing ? &startup : NULL,
+        .snapshot_every = args.snapshot_every,
+        .audit = args.audit,
+    };
+    for (worker_id worker_id = PARENT_ID + 1; worker_id < args.bank_account_workers_count + 1; worker_id++) {
+        bank_client_worker.initial_total += args.initial_balances[worker_id];
+    }
+    if (deinit_channels(bank_client_worker.worker, workers, pipes_log_fd) != 0) defer_return(1);
+    process_stats->ready_ns = stats_now_ns();
+
+    AccountHistory long_histories[MAX_PROCESS_ID + 1];
+    if (args.long_run || args.stream_history) {
+        for (worker_id worker_id = PARENT_ID + 1; worker_id < args.bank_account_workers_count + 1; worker_id++) {
+            if (account_history_init(&long_histories[worker_id], worker_id, args.initial_balances[worker_id], history_max_time) != 0) {
+                fprintf(stderr, "Failed to allocate the balance history of worker %d\n", worker_id);
+                defer_return(1);
+            }
+        }
+        bank_client_worker.long_histories = long_histories;
+        bank_client_worker.streamed = args.stream_history;
+    }
+
+    LoadGenerator load;
+    if (args.load_transfers > 0) {
+        if (load_init(&load, args.load_transfers, args.load_seed, args.load_distribution, PARENT_ID + 1, args.bank_account_workers_count, args.initial_balances) != 0) {
+            fprintf(stderr, "Failed to allocate the load generator for %d transfers\n", args.load_transfers);
+            defer_return(1);
+        }
+        bank_client_worker.load = &load;
+    }
+
+    if (args.issuers > 0) {
+        pool.issuers = calloc(args.issuers, sizeof(TransferIssuer));
+        if (pool.issuers == NULL) {
+            fprintf(stderr, "Failed to allocate %d transfer issuers\n", args.issuers);
+            defer_return(1);
+        }
+        bank_client_worker.pool = &pool;
+        for (int i = 0; i < args.issuers; i++) {
+            TransferIssuer* issuer = &pool.issuers[i];
+            // issuer i takes the sources from first on, the load and the accounts are split as evenly as they go
+            local_id first = PARENT_ID + 1 + i * args.bank_account_workers_count / args.issuers;
+            local_id accounts = PARENT_ID + 1 + (i + 1) * args.bank_account_workers_count / args.issuers - first;
+            for (local_id src = first; src < first + accounts; src++) pool.owner[src] = i;
 
+            issuer->index = i;
+            issuer->client = bank_client_worker;
+            issuer->client.issuer = issuer;
+            issuer->client.load = NULL;
+            if (i > 0) issuer->client.startup = NULL;
+            if (args.load_transfers > 0) {
+                int transfers = (i + 1) * args.load_transfers / args.issuers - i * args.load_transfers / args.issuers;
+                if (load_init(&issuer->load, transfers, args.load_seed + i, args.load_distribution, first, accounts, args.initial_balances) != 0) {
+                    fprintf(stderr, "Failed to allocate the load generator of issuer %d\n", i);
+                    defer_return(1);
+                }
+                issuer->client.load = &issuer->load;
+            }
+            pool.count = i + 1;
+        }
+    }
+
+    if (args.record_trace) {
+        w->trace = open_trace(PARENT_ID, args.bank_account_workers_count, 0, &account_options);
+        if (w->trace == NULL) defer_return(1);
+    }
     int status = execute_bank_client_worker(bank_client_worker);
+    if (w->trace != NULL) {
+        trace_close(w->trace);
+        w->trace = NULL;
+    }
     while (wait(NULL) > 0);
+    for (worker_id worker_id = PARENT_ID + 1; worker_id <= threads_started; worker_id++) {
+        pthread_join(threads[worker_id].thread, NULL);
+        logger_close(threads[worker_id].worker->events_log);
+        if (threads[worker_id].status != 0) status = threads[worker_id].status;
+    }
+    // every account has returned, so the channels can go
+    threads_started = 0;
+    // children are gone, so their counters are final
+    if (args.stats) stats_print(stderr, stats, args.bank_account_workers_count + 1);
+    if (args.mutexl) stats_print_critical_sections(stderr, stats, args.bank_account_workers_count + 1);
+    if (args.pin) print_cpu_placement(stats, args.bank_account_workers_count + 1, cpu_count, stderr);
+    if (args.startup_timing) print_startup_times(&startup, stats, args.bank_account_workers_count + 1, stderr);
+    if (bank_client_worker.load != NULL) load_deinit(bank_client_worker.load);
+    for (int i = 0; i < pool.count; i++) {
+        if (pool.issuers[i].client.load != NULL) load_deinit(&pool.issuers[i].load);
+        free(pool.issuers[i].queued);
+    }
+    free(pool.issuers);
+    if (bank_client_worker.long_histories != NULL) {
+        for (worker_id worker_id = PARENT_ID + 1; worker_id < args.bank_account_workers_count + 1; worker_id++) account_history_free(&long_histories[worker_id]);
+    }
     defer_return(status);
 
 defer:
-    if (workers != NULL) deinit_workers(w, workers, pipes_log_fd);
-    fclose(pipes_log_fd);
-    fclose(events_log_fd);
+    // account threads still running would use the rings after they are unmapped, exit() takes them down instead
+    if (workers != NULL && threads_started == 0) deinit_workers(w, workers, pipes_log_fd);
+    if (events_bin != NULL) event_log_close(events_bin);
+    if (stats != NULL) stats_unmap_shared(stats, args.bank_account_workers_count + 1);
+    logger_close(pipes_log_fd);
+    logger_close(events_log_fd);
+    if (scenario != NULL) dlclose(scenario);
     return result;
 }
@@ -0,0 +1,93 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "ring.h"
+#include "stats.h"
+
+int ring_try_writev(Ring* r, const struct iovec* iov, int iovcnt) {
+    uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = r->tail;
+    size_t size = 0;
+
+    for (int i = 0; i < iovcnt; i++) size += iov[i].iov_len;
+    if (RING_CAPACITY - (tail - head) < size) return -1;
+
+    for (int i = 0; i < iovcnt; i++) {
+        size_t offset = tail % RING_CAPACITY;
+        size_t first = (iov[i].iov_len < RING_CAPACITY - offset) ? iov[i].iov_len : RING_CAPACITY - offset;
+        memcpy(r->data + offset, iov[i].iov_base, first);
+        memcpy(r->data, (const char*)iov[i].iov_base + first, iov[i].iov_len - first);
+        tail += iov[i].iov_len;
+    }
+
+    __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+    return 0;
+}
+
+size_t ring_readable(const Ring* r) {
+    return __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - r->head;
+}
+
+void ring_peek(const Ring* r, size_t offset, void* buf, size_t size) {
+    offset = (r->head + offset) % RING_CAPACITY;
+    size_t first = (size < RING_CAPACITY - offset) ? size : RING_CAPACITY - offset;
+    memcpy(buf, r->data + offset, first);
+    memcpy((char*)buf + first, r->data, size - first);
+}
+
+void ring_consume(Ring* r, size_t size) {
+    __atomic_store_n(&r->head, r->head + size, __ATOMIC_RELEASE);
+    doorbell_ring(&r->space);
+}
+
+uint32_t doorbell_seq(Doorbell* bell) {
+    return __atomic_load_n(&bell->seq, __ATOMIC_ACQUIRE);
+}
+
+void doorbell_ring(Doorbell* bell) {
+    __atomic_add_fetch(&bell->seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&bell->waiters, __ATOMIC_SEQ_CST) != 0) {
+        process_stats->syscalls++;
+        syscall(SYS_futex, &bell->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+int doorbell_wait(Doorbell* bell, uint32_t seq) {
+    int result = 0;
+
+    __atomic_add_fetch(&bell->waiters, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&bell->seq, __ATOMIC_SEQ_CST) == seq) {
+        process_stats->syscalls++;
+        // EAGAIN means the bell was rung in between, EINTR is a plain wake-up for the caller's re-check
+        if (syscall(SYS_futex, &bell->seq, FUTEX_WAIT, seq, NULL, NULL, 0) == -1 && errno != EAGAIN && errno != EINTR) result = -1;
+    }
+    __atomic_sub_fetch(&bell->waiters, 1, __ATOMIC_SEQ_CST);
+    return result;
+}
+
+/* Tells the core we are spinning, which saves power and lets a sibling hyper-thread run */
+static void _cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+void doorbell_poll(Doorbell* bell, uint32_t seq) {
+    for (uint32_t check = 1; __atomic_load_n(&bell->seq, __ATOMIC_ACQUIRE) == seq; check++) {
+        _cpu_relax();
+        if (check % RING_POLL_YIELD == 0) {
+            process_stats->syscalls++;
+            sched_yield();
+        }
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef __IFMO_DISTRIBUTED_CLASS_RING__H
+#define __IFMO_DISTRIBUTED_CLASS_RING__H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+enum {
+    RING_CAPACITY = 1 << 16, ///< bytes per directed channel, same as a default pipe buffer
+    RING_SPIN_CHECKS = 256,  ///< re-checks before a waiter falls back to sleeping in the kernel
+    RING_POLL_YIELD = 4096   ///< checks between sched_yield() calls of a busy-polling waiter
+};
+
+/**
+ * Futex word senders bump after publishing, so a sleeping receiver wakes up.
+ * Lives in memory shared by both sides.
+ */
+typedef struct {
+    uint32_t seq;
+    uint32_t waiters;
+} Doorbell;
+
+/**
+ * Lock-free single-producer/single-consumer byte ring. Frames are written whole,
+ * so a reader that sees a header also sees its payload.
+ */
+typedef struct {
+    uint32_t head __attribute__((aligned(64))); ///< read position, advanced by the consumer only
+    uint32_t tail __attribute__((aligned(64))); ///< write position, advanced by the producer only
+    Doorbell space;                             ///< rung by the consumer when it frees room
+    char data[RING_CAPACITY] __attribute__((aligned(64)));
+} Ring;
+
+/** Writes the gathered buffers as one unit.
+ *
+ * @return 0 on success, -1 if the ring does not have room for all of them
+ */
+int ring_try_writev(Ring* r, const struct iovec* iov, int iovcnt);
+
+size_t ring_readable(const Ring* r);
+
+/** Copies size bytes starting offset bytes past the read position without consuming them,
+ *  offset + size must not exceed ring_readable() */
+void ring_peek(const Ring* r, size_t offset, void* buf, size_t size);
+
+/** Drops size bytes from the read position and wakes a producer waiting for room */
+void ring_consume(Ring* r, size_t size);
+
+uint32_t doorbell_seq(Doorbell* bell);
+
+void doorbell_ring(Doorbell* bell);
+
+/** Sleeps until the bell is rung after seq was read, returns right away if it already was */
+int doorbell_wait(Doorbell* bell, uint32_t seq);
+
+/** Same as doorbell_wait() without ever sleeping: spins on the bell with a pause instruction,
+ *  so the ringer needs no futex wake-up either. The core is only given up every RING_POLL_YIELD
+ *  checks, in case a peer shares it. */
+void doorbell_poll(Doorbell* bell, uint32_t seq);
+
+#endif // __IFMO_DISTRIBUTED_CLASS_RING__H
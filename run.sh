@@ -1,6 +1,6 @@
 #!/bin/bash
 
-rm -f events.log pipes.log
+rm -f events.log events.bin pipes.log
 
 export LD_LIBRARY_PATH="$LD_LIBRARY_PATH:$(realpath ./lib64)"
 LD_PRELOAD=$(realpath ./lib64/libruntime.so) ./pa2 "$@"
@@ -0,0 +1,61 @@
+#include "lamport.h"
+#include "snapshot.h"
+#include "stats.h"
+
+int snapshot_start(SnapshotCollector* c, Worker* w) {
+    SnapshotMarker marker = { .s_id = c->id + 1 };
+
+    increment_lamport_time();
+    MessageHeader header = { .s_magic = MESSAGE_MAGIC, .s_type = SNAPSHOT_MARKER, .s_local_time = get_lamport_time_wide(), .s_payload_len = sizeof(marker) };
+    if (send_multicast_iov(w, &header, &marker) != 0) return -1;
+
+    *c = (SnapshotCollector) { .id = marker.s_id, .running = true, .started_ns = stats_now_ns() };
+    return 0;
+}
+
+int snapshot_on_report(SnapshotCollector* c, const Worker* w, const SnapshotReport* report) {
+    if (!c->running || report->s_id != c->id) return -1;
+
+    c->balance += report->s_balance;
+    c->in_flight += report->s_in_flight;
+    c->reports++;
+    if (c->reports < w->nbr_count) return 0;
+    c->running = false;
+    return 1;
+}
+
+int snapshot_on_marker(SnapshotState* st, Worker* w, local_id from, const SnapshotMarker* marker, balance_t balance) {
+    if (marker->s_id > st->report.s_id) {
+        st->report = (SnapshotReport) { .s_id = marker->s_id, .s_balance = balance };
+        st->reported = false;
+        st->markers_missing = 0;
+        for (worker_id id = PARENT_ID + 1; id < w->nbr_count + 1; id++) {
+            st->recording[id] = (id != w->id);
+            if (id != w->id) st->markers_missing++;
+        }
+
+        increment_lamport_time();
+        MessageHeader header = { .s_magic = MESSAGE_MAGIC, .s_type = SNAPSHOT_MARKER, .s_local_time = get_lamport_time_wide(), .s_payload_len = sizeof(*marker) };
+        for (worker_id id = PARENT_ID + 1; id < w->nbr_count + 1; id++) {
+            if (id == w->id) continue;
+            if (send_iov(w, id, &header, marker) != 0) return -1;
+        }
+    }
+
+    // the parent's marker may come after those of the accounts, it starts nothing then
+    if (from != PARENT_ID && st->recording[from]) {
+        st->recording[from] = false;
+        st->markers_missing--;
+    }
+    if (st->markers_missing != 0 || st->reported) return 0;
+
+    increment_lamport_time();
+    MessageHeader header = { .s_magic = MESSAGE_MAGIC, .s_type = SNAPSHOT_REPORT, .s_local_time = get_lamport_time_wide(), .s_payload_len = sizeof(st->report) };
+    if (send_iov(w, PARENT_ID, &header, &st->report) != 0) return -1;
+    st->reported = true;
+    return 0;
+}
+
+void snapshot_on_transfer(SnapshotState* st, local_id from, balance_t amount) {
+    if (st->recording[from]) st->report.s_in_flight += amount;
+}
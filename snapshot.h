@@ -0,0 +1,77 @@
+#ifndef __IFMO_DISTRIBUTED_CLASS_SNAPSHOT__H
+#define __IFMO_DISTRIBUTED_CLASS_SNAPSHOT__H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "banking.h"
+#include "worker.h"
+
+/*
+ * Chandy-Lamport snapshots of the money in the bank, taken while transfers keep flowing.
+ * The parent starts one by sending a marker to every account. An account records its
+ * balance at the first marker of a snapshot and passes the marker on to every other
+ * account. From then on, until the marker from an account arrives, it adds up what that
+ * account transfers to it, which is the money that was in flight at the cut. Channels
+ * are FIFO, so everything sent before the sender's marker is counted and nothing after it.
+ * Once every marker is in, the account reports to the parent.
+ *
+ * Channels from the parent carry orders, not money, so they are never recorded.
+ */
+
+enum {
+    SNAPSHOT_MARKER = CS_RELEASE + 1, ///< message with SnapshotMarker
+    SNAPSHOT_REPORT                   ///< message with SnapshotReport, from an account to the parent
+};
+
+typedef struct {
+    uint32_t s_id; ///< snapshots are numbered from 1 by the parent
+} __attribute__((packed)) SnapshotMarker;
+
+typedef struct {
+    uint32_t s_id;
+    balance_t s_balance;   ///< balance of the account at the cut
+    balance_t s_in_flight; ///< money sent to the account before the cut and received after it
+} __attribute__((packed)) SnapshotReport;
+
+/** Snapshot state of an account */
+typedef struct {
+    bool recording[MAX_PROCESS_ID + 1]; ///< channels from accounts whose marker has not arrived yet
+    worker_id markers_missing;
+    bool reported;                      ///< the report of the latest snapshot has gone out
+    SnapshotReport report;              ///< latest snapshot this account took part in, s_id is 0 before the first
+} SnapshotState;
+
+/** Snapshot state of the parent */
+typedef struct {
+    uint32_t id;       ///< latest snapshot started, 0 before the first
+    bool running;
+    worker_id reports; ///< reports received for the running snapshot
+    balance_t balance;
+    balance_t in_flight;
+    int64_t started_ns;
+} SnapshotCollector;
+
+/** Sends a marker of the next snapshot to every account.
+ *
+ * @return 0 on success, -1 if a marker could not be sent
+ */
+int snapshot_start(SnapshotCollector* c, Worker* w);
+
+/** Adds up a report of the running snapshot.
+ *
+ * @return whether it was the last one, -1 if the report belongs to no running snapshot
+ */
+int snapshot_on_report(SnapshotCollector* c, const Worker* w, const SnapshotReport* report);
+
+/** Handles a marker from from, recording balance if it is the first one of its snapshot,
+ *  and reports to the parent once the markers of every account are in.
+ *
+ * @return 0 on success, -1 if a marker or the report could not be sent
+ */
+int snapshot_on_marker(SnapshotState* st, Worker* w, local_id from, const SnapshotMarker* marker, balance_t balance);
+
+/** Counts amount received from account from if that channel is being recorded */
+void snapshot_on_transfer(SnapshotState* st, local_id from, balance_t amount);
+
+#endif // __IFMO_DISTRIBUTED_CLASS_SNAPSHOT__H
@@ -0,0 +1,196 @@
+#define _DEFAULT_SOURCE
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "stats.h"
+
+static ProcessStats scratch_stats;
+
+__thread ProcessStats* process_stats = &scratch_stats;
+
+ProcessStats* stats_map_shared(int count) {
+    void* all = mmap(NULL, count * sizeof(ProcessStats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    return (all == MAP_FAILED) ? NULL : all;
+}
+
+void stats_unmap_shared(ProcessStats* all, int count) {
+    munmap(all, count * sizeof(ProcessStats));
+}
+
+void stats_attach(ProcessStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    process_stats = stats;
+}
+
+int64_t stats_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int _histogram_bucket(uint64_t ns) {
+    if (ns < HISTOGRAM_SUB_BUCKETS) return ns;
+    int exponent = 63 - __builtin_clzll(ns);
+    int sub_bucket = (ns >> (exponent - 3)) & (HISTOGRAM_SUB_BUCKETS - 1);
+    return (exponent - 2) * HISTOGRAM_SUB_BUCKETS + sub_bucket;
+}
+
+static uint64_t _histogram_bucket_max(int bucket) {
+    if (bucket < HISTOGRAM_SUB_BUCKETS) return bucket;
+    int exponent = bucket / HISTOGRAM_SUB_BUCKETS + 2;
+    uint64_t step = 1ULL << (exponent - 3);
+    return (HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS) * step + step - 1;
+}
+
+void histogram_record(Histogram* h, uint64_t ns) {
+    h->counts[_histogram_bucket(ns)]++;
+    h->samples++;
+    h->total_ns += ns;
+    if (ns > h->max_ns) h->max_ns = ns;
+}
+
+uint64_t histogram_quantile(const Histogram* h, double q) {
+    uint64_t target = (uint64_t)(q * h->samples);
+    uint64_t seen = 0;
+
+    if (h->samples == 0) return 0;
+    if (target >= h->samples) return h->max_ns;
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        seen += h->counts[bucket];
+        if (seen > target) {
+            uint64_t max = _histogram_bucket_max(bucket);
+            return (max < h->max_ns) ? max : h->max_ns;
+        }
+    }
+    return h->max_ns;
+}
+
+static void _histogram_merge(Histogram* into, const Histogram* h) {
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) into->counts[bucket] += h->counts[bucket];
+    into->samples += h->samples;
+    into->total_ns += h->total_ns;
+    if (h->max_ns > into->max_ns) into->max_ns = h->max_ns;
+}
+
+static void _traffic_merge(TrafficCounter* into, const TrafficCounter* from, int count) {
+    for (int i = 0; i < count; i++) {
+        into[i].messages += from[i].messages;
+        into[i].bytes += from[i].bytes;
+    }
+}
+
+void stats_merge(ProcessStats* into, const ProcessStats* from) {
+    into->syscalls += from->syscalls;
+    into->eagain_retries += from->eagain_retries;
+    into->waits += from->waits;
+    _traffic_merge(into->sent_to, from->sent_to, MAX_PROCESS_ID + 1);
+    _traffic_merge(into->received_from, from->received_from, MAX_PROCESS_ID + 1);
+    _traffic_merge(into->sent_by_type, from->sent_by_type, STATS_MESSAGE_TYPES);
+    _traffic_merge(into->received_by_type, from->received_by_type, STATS_MESSAGE_TYPES);
+    _histogram_merge(&into->receive_any_blocked, &from->receive_any_blocked);
+    _histogram_merge(&into->send_blocked, &from->send_blocked);
+    _histogram_merge(&into->transfer_round_trip, &from->transfer_round_trip);
+    _histogram_merge(&into->cs_wait, &from->cs_wait);
+    if (from->cs_first_request_ns != 0 && (into->cs_first_request_ns == 0 || from->cs_first_request_ns < into->cs_first_request_ns)) {
+        into->cs_first_request_ns = from->cs_first_request_ns;
+    }
+    if (from->cs_last_release_ns > into->cs_last_release_ns) into->cs_last_release_ns = from->cs_last_release_ns;
+    // the process is ready once its last thread is
+    if (from->ready_ns > into->ready_ns) into->ready_ns = from->ready_ns;
+}
+
+void stats_count_message(TrafficCounter* by_peer, TrafficCounter* by_type, local_id peer, int16_t type, uint64_t bytes) {
+    int type_slot = (type >= 0 && type < STATS_MESSAGE_TYPES) ? type : STATS_MESSAGE_TYPES - 1;
+    by_peer[peer].messages++;
+    by_peer[peer].bytes += bytes;
+    by_type[type_slot].messages++;
+    by_type[type_slot].bytes += bytes;
+}
+
+static TrafficCounter _traffic_total(const TrafficCounter* counters, int count) {
+    TrafficCounter total = { 0 };
+    for (int i = 0; i < count; i++) {
+        total.messages += counters[i].messages;
+        total.bytes += counters[i].bytes;
+    }
+    return total;
+}
+
+static void _print_histogram(FILE* out, const char* name, const Histogram* h) {
+    if (h->samples == 0) {
+        fprintf(out, "  %-20s no samples\n", name);
+        return;
+    }
+    fprintf(out, "  %-20s n %llu  mean %.1f us  p50 %.1f  p90 %.1f  p99 %.1f  max %.1f us\n", name, (unsigned long long)h->samples,
+        h->total_ns / 1e3 / h->samples, histogram_quantile(h, 0.5) / 1e3, histogram_quantile(h, 0.9) / 1e3, histogram_quantile(h, 0.99) / 1e3,
+        h->max_ns / 1e3);
+}
+
+void stats_print(FILE* out, const ProcessStats* all, int count) {
+    static ProcessStats merged;
+    memset(&merged, 0, sizeof(merged));
+
+    fprintf(out, "%4s | %10s | %8s | %8s | %10s | %12s | %10s | %12s\n", "proc", "syscalls", "eagain", "waits", "sent msgs", "sent B", "recv msgs", "recv B");
+    for (int id = 0; id < count; id++) {
+        const ProcessStats* s = &all[id];
+        TrafficCounter sent = _traffic_total(s->sent_to, MAX_PROCESS_ID + 1);
+        TrafficCounter received = _traffic_total(s->received_from, MAX_PROCESS_ID + 1);
+        fprintf(out, "%4d | %10llu | %8llu | %8llu | %10llu | %12llu | %10llu | %12llu\n", id, (unsigned long long)s->syscalls,
+            (unsigned long long)s->eagain_retries, (unsigned long long)s->waits, (unsigned long long)sent.messages, (unsigned long long)sent.bytes,
+            (unsigned long long)received.messages, (unsigned long long)received.bytes);
+
+        merged.syscalls += s->syscalls;
+        merged.eagain_retries += s->eagain_retries;
+        merged.waits += s->waits;
+        for (int type = 0; type < STATS_MESSAGE_TYPES; type++) {
+            merged.sent_by_type[type].messages += s->sent_by_type[type].messages;
+            merged.sent_by_type[type].bytes += s->sent_by_type[type].bytes;
+        }
+        _histogram_merge(&merged.receive_any_blocked, &s->receive_any_blocked);
+        _histogram_merge(&merged.send_blocked, &s->send_blocked);
+        _histogram_merge(&merged.transfer_round_trip, &s->transfer_round_trip);
+        _histogram_merge(&merged.cs_wait, &s->cs_wait);
+    }
+
+    fprintf(out, "sent msgs, row = from, column = to:\n%4s |", "");
+    for (int to = 0; to < count; to++) fprintf(out, " %6d", to);
+    fprintf(out, "\n");
+    for (int from = 0; from < count; from++) {
+        fprintf(out, "%4d |", from);
+        for (int to = 0; to < count; to++) fprintf(out, " %6llu", (unsigned long long)all[from].sent_to[to].messages);
+        fprintf(out, "\n");
+    }
+
+    fprintf(out, "total: syscalls %llu, eagain %llu, waits %llu\n", (unsigned long long)merged.syscalls, (unsigned long long)merged.eagain_retries,
+        (unsigned long long)merged.waits);
+    fprintf(out, "sent by type:");
+    for (int type = 0; type < STATS_MESSAGE_TYPES; type++) {
+        if (merged.sent_by_type[type].messages == 0) continue;
+        fprintf(out, " [%d] %llu msgs %llu B;", type, (unsigned long long)merged.sent_by_type[type].messages,
+            (unsigned long long)merged.sent_by_type[type].bytes);
+    }
+    fprintf(out, "\n");
+    _print_histogram(out, "receive_any blocked", &merged.receive_any_blocked);
+    _print_histogram(out, "send blocked", &merged.send_blocked);
+    _print_histogram(out, "transfer round trip", &merged.transfer_round_trip);
+    _print_histogram(out, "critical section wait", &merged.cs_wait);
+}
+
+void stats_print_critical_sections(FILE* out, const ProcessStats* all, int count) {
+    uint64_t entries = 0;
+    uint64_t messages = 0;
+
+    fprintf(out, "%4s | %10s | %10s | %12s\n", "proc", "CS entries", "entries/s", "mean wait us");
+    for (int id = 0; id < count; id++) {
+        const ProcessStats* s = &all[id];
+        double seconds = (s->cs_last_release_ns - s->cs_first_request_ns) / 1e9;
+        double mean_wait_us = (s->cs_wait.samples > 0) ? s->cs_wait.total_ns / 1e3 / s->cs_wait.samples : 0;
+
+        fprintf(out, "%4d | %10llu | %10.0f | %12.1f\n", id, (unsigned long long)s->cs_wait.samples, (seconds > 0) ? s->cs_wait.samples / seconds : 0,
+            mean_wait_us);
+        entries += s->cs_wait.samples;
+        messages += s->sent_by_type[CS_REQUEST].messages + s->sent_by_type[CS_REPLY].messages;
+    }
+    fprintf(out, "total: %llu CS entries, %.1f CS messages per entry\n", (unsigned long long)entries, (entries > 0) ? (double)messages / entries : 0);
+}
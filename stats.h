@@ -0,0 +1,86 @@
+#ifndef __IFMO_DISTRIBUTED_CLASS_STATS__H
+#define __IFMO_DISTRIBUTED_CLASS_STATS__H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "ipc.h"
+
+enum {
+    HISTOGRAM_SUB_BUCKETS = 8,                          ///< linear steps inside each power of two, about 12% precision
+    HISTOGRAM_BUCKETS = 64 * HISTOGRAM_SUB_BUCKETS,     ///< covers every uint64_t nanosecond value
+    STATS_MESSAGE_TYPES = 16                            ///< MessageType values counted separately, larger ones share the last slot
+};
+
+/**
+ * Log-linear latency histogram in the spirit of HdrHistogram: values are grouped
+ * by their highest set bit and then into HISTOGRAM_SUB_BUCKETS equal steps.
+ */
+typedef struct {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t samples;
+    uint64_t total_ns;
+    uint64_t max_ns;
+} Histogram;
+
+typedef struct {
+    uint64_t messages;
+    uint64_t bytes;
+} TrafficCounter;
+
+/**
+ * Counters of one process. They live in memory shared with the parent,
+ * so the parent can aggregate them once its children have exited.
+ */
+typedef struct {
+    uint64_t syscalls;       ///< read/writev/poll/epoll/futex calls made by the IPC layer
+    uint64_t eagain_retries; ///< calls that came back with EAGAIN and were retried after a wait
+    uint64_t waits;          ///< times the process went to sleep waiting for a peer
+    TrafficCounter sent_to[MAX_PROCESS_ID + 1];
+    TrafficCounter received_from[MAX_PROCESS_ID + 1];
+    TrafficCounter sent_by_type[STATS_MESSAGE_TYPES];
+    TrafficCounter received_by_type[STATS_MESSAGE_TYPES];
+    Histogram receive_any_blocked; ///< receive_any calls that had nothing buffered, time until a frame arrived
+    Histogram send_blocked;        ///< sends that found the channel full, time until the frame was out
+    Histogram transfer_round_trip; ///< transfer() calls, time until the client could issue the next one
+    Histogram cs_wait;             ///< request_cs() calls, time until every other account had replied
+    int64_t cs_first_request_ns;   ///< stats_now_ns() of the first request_cs(), 0 if there was none
+    int64_t cs_last_release_ns;    ///< stats_now_ns() of the last release_cs()
+    int64_t ready_ns;              ///< stats_now_ns() once the process had set up its channels, for --startup-timing
+    int cpu;                       ///< CPU the process ran on once pinned, for --pin
+} ProcessStats;
+
+/** Counters of the running process or thread, a scratch block until stats_attach() */
+extern __thread ProcessStats* process_stats;
+
+/** Maps zeroed stats for count processes into memory that stays shared across fork().
+ *
+ * @return the array, NULL with errno set on failure
+ */
+ProcessStats* stats_map_shared(int count);
+
+void stats_unmap_shared(ProcessStats* all, int count);
+
+/** Makes the running process or thread count into stats from now on */
+void stats_attach(ProcessStats* stats);
+
+int64_t stats_now_ns(void);
+
+void histogram_record(Histogram* h, uint64_t ns);
+
+/** @return the upper bound of the bucket holding the q-th quantile, 0 for an empty histogram */
+uint64_t histogram_quantile(const Histogram* h, double q);
+
+/** Adds the counters and histograms of another thread of the same process to into and widens its
+ *  critical section and ready times to cover the thread's. The CPU of into is kept. */
+void stats_merge(ProcessStats* into, const ProcessStats* from);
+
+void stats_count_message(TrafficCounter* by_peer, TrafficCounter* by_type, local_id peer, int16_t type, uint64_t bytes);
+
+/** Prints one line per process followed by totals and the merged histograms */
+void stats_print(FILE* out, const ProcessStats* all, int count);
+
+/** Prints critical section entries per second and mean wait of each process, then the CS messages an entry took */
+void stats_print_critical_sections(FILE* out, const ProcessStats* all, int count);
+
+#endif // __IFMO_DISTRIBUTED_CLASS_STATS__H
@@ -17,6 +17,34 @@ def build_with_source(source_code: str) -> None:
     subprocess.run(["./build.sh"], check=True, capture_output=True)
 
 
+@pytest.fixture(scope="session")
+def scenario_dir(tmp_path_factory: pytest.TempPathFactory) -> Path:
+    # one pa2 without a bank_robbery() of its own runs every scenario and every --load
+    Path("bank_robbery.c").unlink(missing_ok=True)
+    subprocess.run(["./build.sh"], check=True, capture_output=True)
+    return tmp_path_factory.mktemp("scenarios")
+
+
+def build_scenario(directory: Path, name: str, source_code: str) -> Path:
+    scenario = directory / f"{name}.so"
+    if not scenario.exists():
+        source = directory / f"{name}.c"
+        source.write_text(source_code)
+        subprocess.run(["./build_scenario.sh", str(source), str(scenario)], check=True, capture_output=True)
+    return scenario
+
+
+@pytest.fixture(scope="session")
+def empty_scenario(scenario_dir: Path) -> Path:
+    return build_scenario(scenario_dir, "empty", '#include "banking.h"\nvoid bank_robbery(void * parent_data, local_id max_id) {}\n')
+
+
+def render_binary_events() -> str:
+    subprocess.run(["./tools/build.sh"], check=True, capture_output=True)
+    result = subprocess.run(["./tools/events2text", "events.bin"], check=True, capture_output=True, text=True)
+    return result.stdout
+
+
 @dataclass
 class Transfer:
     src: int
@@ -201,10 +229,34 @@ class TransferTestCase:
     ],
     ids=lambda test_case: test_case.test_id,
 )
-def test_transfer(test_case: TransferTestCase) -> None:
-    build_with_source(test_case.robbery_source_code)
+@pytest.mark.parametrize(
+    argnames="mode_args",
+    argvalues=[
+        [],
+        ["--window", "8"],
+        ["--batch", "4", "--window", "8"],
+        ["--transport", "shm"],
+        ["--transport", "shm", "--window", "8"],
+        ["--event-log", "binary"],
+        ["--topology", "lazy", "--window", "8"],
+        ["--stats", "--window", "8"],
+        ["--threads", "--window", "8"],
+        ["--fast-start", "--startup-timing", "--window", "8"],
+        ["--transport", "shm", "--pin", "--busy-poll", "--window", "8"],
+        ["--stream-history", "--window", "8"],
+        ["--audit", "--window", "8"],
+        ["--rx-priority", "--batch", "2", "--window", "8"],
+        ["--issuers", "2", "--window", "8"],
+    ],
+    ids=["stop_and_wait", "window_8", "batch_4", "shm", "shm_window_8", "binary_log", "lazy_window_8", "stats", "threads", "fast_start", "pin_busy_poll", "stream_history", "audit", "rx_priority", "issuers"],
+)
+def test_transfer(test_case: TransferTestCase, mode_args: list[str], scenario_dir: Path) -> None:
+    scenario = build_scenario(scenario_dir, test_case.test_id, test_case.robbery_source_code)
 
     ret, stdout, stderr = run_program(
+        *mode_args,
+        "--scenario",
+        str(scenario),
         "-p",
         str(test_case.num_processes),
         *[str(b) for b in test_case.initial_balances],
@@ -215,7 +267,7 @@ def test_transfer(test_case: TransferTestCase) -> None:
     events_log = Path("events.log")
     assert events_log.exists()
 
-    events = events_log.read_text()
+    events = render_binary_events() if "--event-log" in mode_args else events_log.read_text()
     total_processes = test_case.num_processes + 1
 
     for i in range(total_processes):
@@ -267,3 +319,232 @@ def test_transfer(test_case: TransferTestCase) -> None:
     for i, total_str in enumerate(total_values):
         total_at_time = int(total_str)
         assert total_at_time == test_case.expected_total_balance
+
+    if "--stats" in mode_args:
+        for i in range(total_processes):
+            assert re.search(rf"^\s*{i} \|(\s*\d+\s*\|){{6}}\s*\d+$", stderr, re.MULTILINE)
+        assert re.search(r"^\s*transfer round trip\s+(n [0-9]+|no samples)", stderr, re.MULTILINE)
+    if "--startup-timing" in mode_args:
+        for phase in ["setup", "channels", "spawn", "channel cleanup", "STARTED exchange"]:
+            assert re.search(rf"^{phase}\s+\|\s*[0-9.]+ \|\s*[0-9.]+$", stderr, re.MULTILINE)
+    if "--audit" in mode_args:
+        assert re.search(rf"^audit: total \${test_case.expected_total_balance} at all [0-9]+ times of {test_case.num_processes} accounts", stdout, re.MULTILINE)
+    if "--pin" in mode_args:
+        assert re.search(rf"^{total_processes} processes pinned to [0-9]+ CPUs", stderr, re.MULTILINE)
+        for i in range(total_processes):
+            assert re.search(rf"^\s*{i} \|\s*[0-9]+$", stderr, re.MULTILINE)
+
+
+def test_linked_bank_robbery() -> None:
+    build_with_source('#include "banking.h"\nvoid bank_robbery(void * parent_data, local_id max_id) { transfer(parent_data, 1, 2, 3); }\n')
+
+    ret, stdout, stderr = run_program("-p", "2", "10", "20")
+
+    assert ret == 0
+    assert re.search(r"^[0-9]+: process 1 transferred \$ ?3 to process 2$", Path("events.log").read_text(), re.MULTILINE)
+
+
+@pytest.mark.parametrize(argnames="mode_args", argvalues=[[], ["--long-run"]], ids=["classic", "long_run"])
+def test_audit_violation(mode_args: list[str], scenario_dir: Path) -> None:
+    # 2 * $30000 leave account 1 while it has $10, which wraps balance_t, the second order makes the money in the histories add up wrong
+    scenario = build_scenario(
+        scenario_dir,
+        "balance_wrap",
+        '#include "banking.h"\nvoid bank_robbery(void * parent_data, local_id max_id) { transfer(parent_data, 1, 2, 30000); transfer(parent_data, 1, 2, 30000); }\n',
+    )
+
+    ret, stdout, stderr = run_program(*mode_args, "--audit", "--scenario", str(scenario), "-p", "2", "10", "10")
+
+    assert ret != 0
+    assert re.search(r"^audit: total \$-?[0-9]+ instead of \$20 at t=[0-9]+, checked in", stdout, re.MULTILINE)
+
+
+@pytest.mark.parametrize(argnames="distribution", argvalues=["uniform", "zipf", "ring"])
+@pytest.mark.usefixtures("scenario_dir")
+def test_load_generator(distribution: str) -> None:
+    balances = [10, 20, 30, 40, 50]
+    ret, stdout, stderr = run_program(
+        "--load",
+        "40",
+        "--distribution",
+        distribution,
+        "--window",
+        "8",
+        "-p",
+        str(len(balances)),
+        *[str(b) for b in balances],
+    )
+
+    assert ret == 0
+    assert re.search(r"^load: 40 transfers in", stdout, re.MULTILINE)
+    assert re.search(rf"^load: conservation ok, total \${sum(balances)} at every t$", stdout, re.MULTILINE)
+
+    events = Path("events.log").read_text()
+    assert len(re.findall(r"^[0-9]+: process [0-9]+ transferred", events, re.MULTILINE)) == 40
+
+
+@pytest.mark.parametrize(argnames="transport", argvalues=["pipe", "shm"])
+@pytest.mark.usefixtures("scenario_dir")
+def test_issuers(transport: str) -> None:
+    balances = [10, 20, 30, 40, 50, 60]
+    ret, stdout, stderr = run_program(
+        "--issuers",
+        "3",
+        "--long-run",
+        "--transport",
+        transport,
+        "--load",
+        "600",
+        "--window",
+        "8",
+        "-p",
+        str(len(balances)),
+        *[str(b) for b in balances],
+    )
+
+    assert ret == 0
+    assert re.search(r"^load: 600 transfers in", stdout, re.MULTILINE)
+    assert re.search(rf"^Total \${sum(balances)} at every time$", stdout, re.MULTILINE)
+
+    events = Path("events.log").read_text()
+    assert len(re.findall(r"^[0-9]+: process [0-9]+ transferred", events, re.MULTILINE)) == 600
+
+
+def test_issuers_run_robbery_once(scenario_dir: Path) -> None:
+    scenario = build_scenario(
+        scenario_dir,
+        "robbery_once",
+        """
+        #include <stdio.h>
+        #include "banking.h"
+
+        void bank_robbery(void * parent_data, local_id max_id)
+        {
+            fprintf(stderr, "bank_robbery called\\n");
+            for (int i = 1; i <= max_id; ++i) {
+                transfer(parent_data, i, i % max_id + 1, i);
+            }
+        }
+        """,
+    )
+
+    ret, stdout, stderr = run_program("--issuers", "2", "--window", "8", "--scenario", str(scenario), "-p", "4", "10", "10", "10", "10")
+
+    assert ret == 0
+    assert stderr.count("bank_robbery called") == 1
+    events = Path("events.log").read_text()
+    for i in range(1, 5):
+        assert re.search(rf"^[0-9]+: process {i} transferred \$ ?{i} to process {i % 4 + 1}$", events, re.MULTILINE)
+
+
+@pytest.mark.parametrize(argnames="transport", argvalues=["pipe", "shm"])
+@pytest.mark.usefixtures("scenario_dir")
+def test_long_run(transport: str) -> None:
+    # enough transfers to carry Lamport time past the 16 bits of timestamp_t
+    balances = [10, 20, 30, 40, 50]
+    ret, stdout, stderr = run_program(
+        "--long-run",
+        "--audit",
+        "--transport",
+        transport,
+        "--load",
+        "40000",
+        "--window",
+        "8",
+        "-p",
+        str(len(balances)),
+        *[str(b) for b in balances],
+    )
+
+    assert ret == 0
+    history_len = re.search(r"^Balance history of 5 accounts over ([0-9]+) Lamport times$", stdout, re.MULTILINE)
+    assert history_len
+    assert int(history_len.group(1)) > 1 << 16
+    assert re.search(rf"^Total \${sum(balances)} at every time$", stdout, re.MULTILINE)
+    assert re.search(r"^load: 40000 transfers in", stdout, re.MULTILINE)
+    assert re.search(rf"^audit: total \${sum(balances)} at all [0-9]+ times of 5 accounts", stdout, re.MULTILINE)
+
+
+@pytest.mark.parametrize(argnames="transport", argvalues=["pipe", "shm"])
+def test_mutexl(transport: str, empty_scenario: Path) -> None:
+    balances = [10, 20, 30]
+    ret, stdout, stderr = run_program(
+        "--mutexl",
+        "--scenario",
+        str(empty_scenario),
+        "--transport",
+        transport,
+        "-p",
+        str(len(balances)),
+        *[str(b) for b in balances],
+    )
+
+    assert ret == 0
+    # print() goes out in pieces, so a line mixed with another one means two processes were inside at once
+    loop_lines = [line for line in stderr.splitlines() if "iteration" in line]
+    for line in loop_lines:
+        assert re.fullmatch(r"process [0-9] is doing [0-9]+ iteration out of [0-9]+", line)
+    for i in range(1, len(balances) + 1):
+        for iteration in range(1, i * 5 + 1):
+            assert f"process {i} is doing {iteration} iteration out of {i * 5}" in loop_lines
+
+    for i in range(1, len(balances) + 1):
+        assert re.search(rf"^\s*{i} \|\s*{i * 5} \|", stderr, re.MULTILINE)
+    # Ricart-Agrawala takes 2(N-1) messages per entry
+    assert re.search(rf"^total: 30 CS entries, {2 * (len(balances) - 1)}\.0 CS messages per entry$", stderr, re.MULTILINE)
+
+
+@pytest.mark.parametrize(argnames="transport", argvalues=["pipe", "shm"])
+@pytest.mark.usefixtures("scenario_dir")
+def test_snapshot(transport: str) -> None:
+    balances = [10, 20, 30, 40, 50]
+    ret, stdout, stderr = run_program(
+        "--long-run",
+        "--transport",
+        transport,
+        "--snapshot-every",
+        "200",
+        "--load",
+        "2000",
+        "--window",
+        "8",
+        "-p",
+        str(len(balances)),
+        *[str(b) for b in balances],
+    )
+
+    assert ret == 0
+    snapshots = re.findall(r"^snapshot ([0-9]+) at t=[0-9]+: accounts \$([0-9]+) \+ in flight \$([0-9]+) = \$([0-9]+),", stdout, re.MULTILINE)
+    assert [int(snapshot[0]) for snapshot in snapshots] == list(range(1, 11))
+    for _, in_accounts, in_flight, total in snapshots:
+        assert int(in_accounts) + int(in_flight) == int(total) == sum(balances)
+
+
+@pytest.mark.parametrize(argnames="transport", argvalues=["pipe", "shm"])
+@pytest.mark.usefixtures("scenario_dir")
+def test_trace_replay(transport: str) -> None:
+    balances = [10, 20, 30]
+    ret, stdout, stderr = run_program(
+        "--record-trace",
+        "--long-run",
+        "--transport",
+        transport,
+        "--load",
+        "400",
+        "--window",
+        "8",
+        "-p",
+        str(len(balances)),
+        *[str(b) for b in balances],
+    )
+    assert ret == 0
+    events = Path("events.log").read_text()
+
+    for i in range(1, len(balances) + 1):
+        ret, replay_stdout, replay_stderr = run_program("--replay-trace", f"trace.{i}.bin")
+        assert ret == 0
+        assert re.search(rf"^replay: account {i}, [0-9]+ messages received and ([0-9]+) sent in", replay_stderr, re.MULTILINE)
+        assert re.search(r"^replay: all [0-9]+ sends match the trace$", replay_stderr, re.MULTILINE)
+        # the account logs the same events as in the recorded run, only the pids of STARTED differ
+        recorded = [line for line in events.splitlines() if re.match(rf"^[0-9]+: process {i} ", line) and "STARTED with" not in line]
+        assert [line for line in replay_stdout.splitlines() if "STARTED with" not in line] == recorded
@@ -0,0 +1,3 @@
+#!/bin/bash
+cd "$(dirname "$0")"
+clang -std=c99 -Wall -pedantic -O2 -I.. ../eventlog.c events2text.c -o events2text
@@ -0,0 +1,64 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "eventlog.h"
+
+/*
+ * Renders a binary event log written with --event-log binary into the lines events.log would hold.
+ *
+ * usage: events2text [events.bin] > events.log
+ */
+
+enum {
+    CONVERT_CHUNK = 4096 ///< records read per fread()
+};
+
+int main(int argc, char** argv) {
+    static EventRecord records[CONVERT_CHUNK];
+    const char* path = (argc > 1) ? argv[1] : events_bin_log;
+    char header_buf[EVENT_LOG_HEADER_LEN];
+    EventLogHeader header;
+    char line[512];
+
+    if (argc > 2) {
+        fprintf(stderr, "usage: %s [%s]\n", argv[0], events_bin_log);
+        return 1;
+    }
+
+    FILE* in = fopen(path, "rb");
+    if (in == NULL) {
+        fprintf(stderr, "Failed to open file %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    if (fread(header_buf, sizeof(header_buf), 1, in) != 1) {
+        fprintf(stderr, "%s is too short for a binary event log\n", path);
+        return 1;
+    }
+    memcpy(&header, header_buf, sizeof(header));
+    if (header.magic != EVENT_LOG_MAGIC || header.version != EVENT_LOG_VERSION || header.record_len != sizeof(EventRecord)) {
+        fprintf(stderr, "%s is not a version %d binary event log\n", path, EVENT_LOG_VERSION);
+        return 1;
+    }
+
+    // a run that did not exit cleanly leaves capacity untrimmed, count still tells how far it got
+    uint64_t remaining = (header.count < header.capacity) ? header.count : header.capacity;
+    while (remaining > 0) {
+        size_t chunk = (remaining < CONVERT_CHUNK) ? remaining : CONVERT_CHUNK;
+        size_t got = fread(records, sizeof(EventRecord), chunk, in);
+        for (size_t i = 0; i < got; i++) {
+            // slots reserved by a process that died before filling them stay zeroed
+            if (records[i].s_type == 0) continue;
+            int len = event_format(&records[i], line, sizeof(line));
+            fwrite(line, 1, len, stdout);
+        }
+        if (got < chunk) {
+            fprintf(stderr, "%s ends %llu records early\n", path, (unsigned long long)(remaining - got));
+            return 1;
+        }
+        remaining -= got;
+    }
+
+    fclose(in);
+    return 0;
+}
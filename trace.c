@@ -0,0 +1,167 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "trace.h"
+
+TraceWriter* trace_open(const char* path, const TraceHeader* header) {
+    TraceWriter* trace = malloc(sizeof(TraceWriter));
+    if (trace == NULL) return NULL;
+
+    trace->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace->fd == -1) goto fail;
+
+    // the file stays sparse past the records written so far
+    trace->map_len = TRACE_INITIAL_CAPACITY;
+    if (ftruncate(trace->fd, trace->map_len) == -1) goto fail_close;
+    trace->map = mmap(NULL, trace->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, trace->fd, 0);
+    if (trace->map == MAP_FAILED) goto fail_close;
+
+    memcpy(trace->map, header, sizeof(*header));
+    ((TraceHeader*)trace->map)->len = 0;
+    trace->len = TRACE_HEADER_LEN;
+    trace->opened_ns = stats_now_ns();
+    trace->dropped = 0;
+    return trace;
+
+fail_close:
+    close(trace->fd);
+fail:
+    free(trace);
+    return NULL;
+}
+
+int trace_append(TraceWriter* trace, TraceDirection direction, local_id peer, lamport_time_t time, const MessageHeader* header, const void* payload) {
+    size_t record_len = sizeof(TraceRecord) + header->s_payload_len;
+
+    if (trace->len + record_len > trace->map_len) {
+        size_t map_len = trace->map_len * 2;
+        char* map = MAP_FAILED;
+        if (ftruncate(trace->fd, map_len) == 0) map = mremap(trace->map, trace->map_len, map_len, MREMAP_MAYMOVE);
+        if (map == MAP_FAILED) {
+            trace->dropped++;
+            return -1;
+        }
+        trace->map = map;
+        trace->map_len = map_len;
+    }
+
+    TraceRecord* record = (TraceRecord*)(trace->map + trace->len);
+    record->s_direction = direction;
+    record->s_peer = peer;
+    record->s_reserved = 0;
+    record->s_time = time;
+    record->s_ns = stats_now_ns() - trace->opened_ns;
+    record->s_header = *header;
+    if (header->s_payload_len > 0) memcpy(record->s_payload, payload, header->s_payload_len);
+    trace->len += record_len;
+    return 0;
+}
+
+void trace_close(TraceWriter* trace) {
+    if (trace->dropped == 0) {
+        ((TraceHeader*)trace->map)->len = trace->len - TRACE_HEADER_LEN;
+    } else {
+        fprintf(stderr, "Dropped %llu messages from the message trace, it will not replay\n", (unsigned long long)trace->dropped);
+    }
+    munmap(trace->map, trace->map_len);
+    if (ftruncate(trace->fd, trace->len) == -1) {
+        fprintf(stderr, "Failed to trim the message trace: %s\n", strerror(errno));
+    }
+    close(trace->fd);
+    free(trace);
+}
+
+TraceReader* trace_load(const char* path, bool paced) {
+    struct stat st;
+
+    TraceReader* trace = calloc(1, sizeof(TraceReader));
+    if (trace == NULL) return NULL;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) goto fail;
+    if (fstat(fd, &st) == -1) goto fail_close;
+    trace->map_len = st.st_size;
+    if (trace->map_len < TRACE_HEADER_LEN) {
+        errno = EINVAL;
+        goto fail_close;
+    }
+    trace->map = mmap(NULL, trace->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (trace->map == MAP_FAILED) goto fail_close;
+    close(fd);
+
+    // a trace left by a process that never got to trace_close() has no length and is not replayed
+    trace->header = (const TraceHeader*)trace->map;
+    if (trace->header->magic != TRACE_MAGIC || trace->header->version != TRACE_VERSION || trace->header->len != trace->map_len - TRACE_HEADER_LEN) {
+        munmap((void*)trace->map, trace->map_len);
+        errno = EINVAL;
+        goto fail;
+    }
+    trace->next[TRACE_SENT] = trace->next[TRACE_RECEIVED] = TRACE_HEADER_LEN;
+    trace->paced = paced;
+    trace->started_ns = stats_now_ns();
+    return trace;
+
+fail_close:
+    close(fd);
+fail:
+    free(trace);
+    return NULL;
+}
+
+/* Finds the next record of a direction and moves its cursor past it, NULL at the end of the trace */
+static const TraceRecord* _next_record(TraceReader* trace, TraceDirection direction) {
+    while (trace->next[direction] + sizeof(TraceRecord) <= trace->map_len) {
+        const TraceRecord* record = (const TraceRecord*)(trace->map + trace->next[direction]);
+        if (trace->next[direction] + sizeof(TraceRecord) + record->s_header.s_payload_len > trace->map_len) break;
+        trace->next[direction] += sizeof(TraceRecord) + record->s_header.s_payload_len;
+        if (record->s_direction == direction) return record;
+    }
+    trace->next[direction] = trace->map_len;
+    return NULL;
+}
+
+const TraceRecord* trace_next_received(TraceReader* trace) {
+    const TraceRecord* record = _next_record(trace, TRACE_RECEIVED);
+    if (record == NULL) return NULL;
+
+    if (trace->paced) {
+        int64_t due_ns = trace->started_ns + record->s_ns;
+        struct timespec due = { .tv_sec = due_ns / 1000000000, .tv_nsec = due_ns % 1000000000 };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR);
+    }
+    trace->received = record;
+    trace->received_count++;
+    return record;
+}
+
+int trace_check_sent(TraceReader* trace, local_id peer, lamport_time_t time, const MessageHeader* header, const void* payload) {
+    const TraceRecord* record = _next_record(trace, TRACE_SENT);
+
+    trace->sent_count++;
+    if (record == NULL || record->s_peer != peer || record->s_time != time || record->s_header.s_type != header->s_type
+        || record->s_header.s_payload_len != header->s_payload_len
+        || (header->s_type != STARTED && header->s_payload_len > 0 && memcmp(record->s_payload, payload, header->s_payload_len) != 0)) {
+        trace->sent_mismatched++;
+        return -1;
+    }
+    return 0;
+}
+
+bool trace_replayed(const TraceReader* trace) {
+    TraceReader rest = *trace;
+    return _next_record(&rest, TRACE_SENT) == NULL && _next_record(&rest, TRACE_RECEIVED) == NULL;
+}
+
+void trace_unload(TraceReader* trace) {
+    munmap((void*)trace->map, trace->map_len);
+    free(trace);
+}
@@ -0,0 +1,123 @@
+#ifndef __IFMO_DISTRIBUTED_CLASS_TRACE__H
+#define __IFMO_DISTRIBUTED_CLASS_TRACE__H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "banking.h"
+#include "ipc.h"
+#include "lamport.h"
+
+/** printf format of the trace file of a process, by its id */
+static const char* const trace_path_fmt = "trace.%d.bin";
+
+typedef enum {
+    TRACE_SENT = 0, ///< the process sent the message to s_peer
+    TRACE_RECEIVED, ///< the process took the message from s_peer out of its channel
+} TraceDirection;
+
+enum {
+    TRACE_MAGIC = 0x52544150,     ///< "PATR"
+    TRACE_VERSION = 1,
+    TRACE_HEADER_LEN = 64,        ///< records start on their own cache line
+    TRACE_INITIAL_CAPACITY = 1 << 20 ///< bytes mapped at first, doubled whenever the records outgrow them
+};
+
+/**
+ * What a replay needs to set the process up again the way it was recorded.
+ */
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    local_id id;
+    uint8_t nbr_count;
+    uint8_t wide_clock;     ///< --long-run
+    uint8_t mutexl;
+    uint8_t stream_history;
+    uint8_t ack_source;     ///< --issuers
+    balance_t balance;      ///< initial balance of an account
+    uint32_t history_max_time;
+    uint64_t len;           ///< bytes of records following the header, set once the trace is closed with none dropped
+} TraceHeader;
+
+/**
+ * One message as the process saw it, followed by its s_header.s_payload_len payload bytes.
+ */
+typedef struct {
+    uint8_t s_direction; ///< TraceDirection
+    local_id s_peer;
+    uint16_t s_reserved;
+    uint32_t s_time; ///< full Lamport time of the message, s_header only keeps its lower 16 bits
+    int64_t s_ns;    ///< stats_now_ns() since the trace was opened, paced replays keep to it
+    MessageHeader s_header;
+    char s_payload[];
+} __attribute__((packed)) TraceRecord;
+
+/**
+ * Trace of the running process, written through a shared mapping of its file.
+ */
+typedef struct {
+    int fd;
+    char* map;
+    size_t map_len;
+    size_t len; ///< header and records written so far
+    int64_t opened_ns;
+    uint64_t dropped; ///< records that did not fit, the trace is incomplete then
+} TraceWriter;
+
+/**
+ * Trace loaded for a replay. Sent and received records are walked separately,
+ * so a replay is fed the messages in the order they were received and the
+ * messages it sends are compared to the recorded ones in the order they were sent.
+ */
+typedef struct {
+    const char* map;
+    size_t map_len;
+    const TraceHeader* header;
+    size_t next[2]; ///< offset of the next record of each TraceDirection
+    const TraceRecord* received; ///< record handed out last, its payload is still to be taken
+    bool paced;     ///< received records are handed out no earlier than they arrived in the recorded run
+    int64_t started_ns;
+    uint64_t received_count;
+    uint64_t sent_count;
+    uint64_t sent_mismatched; ///< sends unlike the recorded ones or beyond them
+} TraceReader;
+
+/** Creates path, replacing an earlier trace, and writes header into it.
+ *
+ * @return the writer, NULL with errno set on failure
+ */
+TraceWriter* trace_open(const char* path, const TraceHeader* header);
+
+/** @return 0 on success, -1 if the file could not grow and the record was dropped */
+int trace_append(TraceWriter* trace, TraceDirection direction, local_id peer, lamport_time_t time, const MessageHeader* header, const void* payload);
+
+/** Stores the length of the records unless some were dropped, cuts the file down to them and frees the writer */
+void trace_close(TraceWriter* trace);
+
+/** Maps a trace written by trace_open() read-only.
+ *
+ * @return the reader, NULL with errno set if the file is not a complete trace
+ */
+TraceReader* trace_load(const char* path, bool paced);
+
+/** Hands out the next received record, after waiting for its time in a paced replay.
+ *
+ * @return the record, NULL once every received message has been replayed
+ */
+const TraceRecord* trace_next_received(TraceReader* trace);
+
+/** Compares a message the replay sends with the next recorded send.
+ *  STARTED carries process ids in its text, so only its header is compared.
+ *
+ * @return 0 if they match, -1 otherwise
+ */
+int trace_check_sent(TraceReader* trace, local_id peer, lamport_time_t time, const MessageHeader* header, const void* payload);
+
+/** @return true once every recorded message has been received and sent again */
+bool trace_replayed(const TraceReader* trace);
+
+void trace_unload(TraceReader* trace);
+
+#endif // __IFMO_DISTRIBUTED_CLASS_TRACE__H
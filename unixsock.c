@@ -0,0 +1,71 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "unixsock.h"
+
+static socklen_t _unixsock_addr(struct sockaddr_un* addr, pid_t root_pid, int id) {
+    *addr = (struct sockaddr_un) { .sun_family = AF_UNIX };
+    // sun_path[0] stays '\0', which puts the name into the abstract namespace
+    int len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "pa23-%d-%d", (int)root_pid, id);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+int unixsock_listen(pid_t root_pid, int id) {
+    struct sockaddr_un addr;
+    socklen_t addr_len = _unixsock_addr(&addr, root_pid, id);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+    if (bind(fd, (struct sockaddr*)&addr, addr_len) == -1 || listen(fd, SOMAXCONN) == -1) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    return fd;
+}
+
+int unixsock_connect(pid_t root_pid, int id, int8_t self_id) {
+    struct sockaddr_un addr;
+    socklen_t addr_len = _unixsock_addr(&addr, root_pid, id);
+
+    // blocking until the id is out, the other side reads it right after accept()
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+    if (connect(fd, (struct sockaddr*)&addr, addr_len) == -1 || write(fd, &self_id, sizeof(self_id)) != sizeof(self_id)
+        || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) == -1) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    return fd;
+}
+
+int unixsock_accept(int listen_fd, int8_t* peer_id) {
+    int fd;
+    while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+        if (errno != EINTR) return -1;
+    }
+
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    while (1) {
+        ssize_t got = read(fd, peer_id, sizeof(*peer_id));
+        if (got == sizeof(*peer_id)) return fd;
+        if (got == 0) errno = ECONNRESET;
+        if (got == -1 && errno == EINTR) continue;
+        if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) && poll(&pfd, 1, -1) >= 0) continue;
+
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+}
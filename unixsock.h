@@ -0,0 +1,30 @@
+#ifndef __IFMO_DISTRIBUTED_CLASS_UNIXSOCK__H
+#define __IFMO_DISTRIBUTED_CLASS_UNIXSOCK__H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Unix stream sockets behind the lazy topology. Kept apart from ipc.h,
+ * whose send() clashes with the one from <sys/socket.h>.
+ *
+ * Listeners use abstract names made of the parent pid and the worker id,
+ * so there is nothing to clean up on the filesystem.
+ */
+
+/** @return a non-blocking listener for worker id, -1 with errno set on failure */
+int unixsock_listen(pid_t root_pid, int id);
+
+/** Connects to worker id and introduces ourselves as self_id.
+ *
+ * @return a non-blocking stream socket, -1 with errno set on failure
+ */
+int unixsock_connect(pid_t root_pid, int id, int8_t self_id);
+
+/** Accepts one pending connection and reads the id its peer introduced itself with.
+ *
+ * @return a non-blocking stream socket, -1 with errno set on failure, EAGAIN if nobody is waiting
+ */
+int unixsock_accept(int listen_fd, int8_t* peer_id);
+
+#endif // __IFMO_DISTRIBUTED_CLASS_UNIXSOCK__H
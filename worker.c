@@ -1,29 +1,36 @@
+#define _DEFAULT_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/sched.h>
+#include <signal.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
+#include "unixsock.h"
 #include "worker.h"
 
-int _set_non_block_fd(int fd, FILE* pipes_log) {
+int _set_non_block_fd(int fd, Logger* pipes_log) {
     int flags = fcntl(fd, F_GETFL, 0);
     if (flags == -1) {
-        fprintf(pipes_log, "Failed to get fd controls: %s", strerror(errno));
+        logger_printf(pipes_log, "Failed to get fd controls: %s", strerror(errno));
         return -1;
     }
     flags |= O_NONBLOCK;
     if (fcntl(fd, F_SETFL, flags) == -1) {
-        fprintf(pipes_log, "Failed to set fd controls: %s", strerror(errno));
+        logger_printf(pipes_log, "Failed to set fd controls: %s", strerror(errno));
         return -1;
     }
     return fd;
 }
 
-int init_duplex_channel(Channel* ch_0, Channel* ch_1, FILE* pipes_log) {
+int init_duplex_channel(Channel* ch_0, Channel* ch_1, Logger* pipes_log) {
     int fildes[2];
 
     if (pipe(fildes) == -1) return -1;
@@ -37,55 +44,273 @@ int init_duplex_channel(Channel* ch_0, Channel* ch_1, FILE* pipes_log) {
     return 0;
 }
 
-void deinit_unused_channels(Worker* s, Worker* workers, FILE* pipes_log) {
+void init_shared_duplex_channel(Channel* ch_0, Channel* ch_1, Ring* rings) {
+    *ch_0 = (Channel) { .read_fd = -1, .write_fd = -1, .rx = &rings[0], .tx = &rings[1] };
+    *ch_1 = (Channel) { .read_fd = -1, .write_fd = -1, .rx = &rings[1], .tx = &rings[0] };
+}
+
+/* Bells first, padded to a cache line, then one ring pair per process pair */
+static size_t _shm_bells_size(worker_id nbr_count) {
+    size_t size = (nbr_count + 1) * sizeof(Doorbell);
+    return (size + 63) / 64 * 64;
+}
+
+static size_t _shm_size(worker_id nbr_count) {
+    return _shm_bells_size(nbr_count) + (size_t)nbr_count * (nbr_count + 1) * sizeof(Ring);
+}
+
+int _init_epoll(Worker* s, Logger* pipes_log) {
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        logger_printf(pipes_log, "Failed to create epoll instance: %s", strerror(errno));
+        return -1;
+    }
+    for (worker_id nbr_id = 0; nbr_id < s->nbr_count + 1; nbr_id++) {
+        if (nbr_id == s->id || s->chs[nbr_id].read_fd == -1) continue;
+        struct epoll_event event = { .events = EPOLLIN, .data = { .u32 = nbr_id } };
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s->chs[nbr_id].read_fd, &event) == -1) {
+            logger_printf(pipes_log, "Failed to watch read_fd=%d: %s", s->chs[nbr_id].read_fd, strerror(errno));
+            close(epoll_fd);
+            return -1;
+        }
+    }
+    if (s->listen_fd != -1) {
+        struct epoll_event event = { .events = EPOLLIN, .data = { .u32 = LISTEN_EPOLL_ID } };
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s->listen_fd, &event) == -1) {
+            logger_printf(pipes_log, "Failed to watch listen_fd=%d: %s", s->listen_fd, strerror(errno));
+            close(epoll_fd);
+            return -1;
+        }
+    }
+    return epoll_fd;
+}
+
+/* Builds the epoll instance of the process running s once the unused channels are gone */
+static int _watch_channels(Worker* s, Logger* pipes_log) {
+    // epoll instances are shared across fork(), so each process builds its own after the split
+    s->epoll_fd = _init_epoll(s, pipes_log);
+    if (s->epoll_fd == -1) return -1;
+    logger_printf(pipes_log, "[deinit_unused_channels] Worker %d watches its channels with epoll_fd=%d\n", s->id, s->epoll_fd);
+    return 0;
+}
+
+static int _compare_fds(const void* a, const void* b) {
+    return *(const int*)a - *(const int*)b;
+}
+
+/* Closes [first, last] with one close_range() call, one close() per descriptor where the kernel lacks it */
+static void _close_fd_range(int first, int last) {
+    if (syscall(SYS_close_range, first, last, 0) == 0) return;
+    for (int fd = first; fd <= last; fd++) close(fd);
+}
+
+int deinit_unused_channels_bulk(Worker* s, Worker* workers, Logger* pipes_log) {
+    int fds[2 * (MAX_PROCESS_ID + 1) * (MAX_PROCESS_ID + 1) + MAX_PROCESS_ID + 1];
+    int count = 0;
+
+    if (s->transport == TRANSPORT_SHM) return 0;
+
+    // the same descriptors deinit_unused_channels() closes
+    for (worker_id nbr_id = 0; nbr_id < s->nbr_count + 1; nbr_id++) {
+        if (nbr_id == s->id) continue;
+
+        Worker* nbr = &workers[nbr_id];
+        if (nbr->listen_fd != -1) fds[count++] = nbr->listen_fd;
+        for (worker_id other_nbr_id = 0; other_nbr_id < s->nbr_count + 1; other_nbr_id++) {
+            if (other_nbr_id == nbr->id) continue;
+            if (s->topology == TOPOLOGY_LAZY && nbr_id != PARENT_ID && other_nbr_id != PARENT_ID) continue;
+            if (nbr->chs[other_nbr_id].read_fd != -1) fds[count++] = nbr->chs[other_nbr_id].read_fd;
+            if (nbr->chs[other_nbr_id].write_fd != -1) fds[count++] = nbr->chs[other_nbr_id].write_fd;
+        }
+    }
+
+    // pipes are created in a row, so the descriptors of other processes form a few long runs
+    qsort(fds, count, sizeof(int), _compare_fds);
+    for (int i = 0; i < count;) {
+        int first = i;
+        while (i + 1 < count && fds[i + 1] == fds[i] + 1) i++;
+        _close_fd_range(fds[first], fds[i]);
+        logger_printf(pipes_log, "[deinit_unused_channels] Worker %d closes fds %d-%d of other processes\n", s->id, fds[first], fds[i]);
+        i++;
+    }
+
+    return _watch_channels(s, pipes_log);
+}
+
+int deinit_unused_channels(Worker* s, Worker* workers, Logger* pipes_log) {
+    // rings are plain memory, there is nothing to close or watch
+    if (s->transport == TRANSPORT_SHM) return 0;
+
     for (worker_id nbr_id = 0; nbr_id < s->nbr_count + 1; nbr_id++) {
         if (nbr_id == s->id) continue;
 
         Worker* nbr = &workers[nbr_id];
+        if (nbr->listen_fd != -1) {
+            close(nbr->listen_fd);
+            logger_printf(pipes_log, "[deinit_unused_channels] Worker %d closes listener of process %d (listen_fd=%d)\n", s->id, nbr_id, nbr->listen_fd);
+        }
         for (worker_id other_nbr_id = 0; other_nbr_id < s->nbr_count + 1; other_nbr_id++) {
             if (other_nbr_id == nbr->id) continue;
+            // without the mesh only channels to the parent exist before fork(), which keeps this loop O(N)
+            if (s->topology == TOPOLOGY_LAZY && nbr_id != PARENT_ID && other_nbr_id != PARENT_ID) continue;
             close(nbr->chs[other_nbr_id].read_fd);
             close(nbr->chs[other_nbr_id].write_fd);
-            fprintf(pipes_log, "[deinit_unused_channels] Worker %d closes semi-duplex channel between processes %d and %d (read_fd=%d write_fd=%d)\n", s->id, nbr_id, other_nbr_id, nbr->chs[other_nbr_id].read_fd, nbr->chs[other_nbr_id].write_fd);
-            fflush(pipes_log);
+            logger_printf(pipes_log, "[deinit_unused_channels] Worker %d closes semi-duplex channel between processes %d and %d (read_fd=%d write_fd=%d)\n", s->id, nbr_id, other_nbr_id, nbr->chs[other_nbr_id].read_fd, nbr->chs[other_nbr_id].write_fd);
+        }
+    }
+
+    return _watch_channels(s, pipes_log);
+}
+
+worker_id spawn_workers_tree(worker_id first, worker_id last) {
+    worker_id self = PARENT_ID;
+
+    while (first <= last) {
+        worker_id mid = first + (last - first) / 2;
+        // only the parent forks plainly, its descendants hand their children over to it
+        pid_t pid = (self == PARENT_ID) ? fork() : (pid_t)syscall(SYS_clone, CLONE_PARENT | SIGCHLD, NULL, NULL, NULL, 0);
+        if (pid == -1) {
+            fprintf(stderr, "Failed to fork a new process for worker %d: %s\n", first, strerror(errno));
+            // workers of the failed range never start, so the run cannot finish
+            if (self != PARENT_ID) kill(getppid(), SIGTERM);
+            return -1;
+        }
+        if (pid == 0) {
+            self = first;
+            first = first + 1;
+            last = mid;
+        } else {
+            first = mid + 1;
         }
     }
+    return self;
 }
 
-void init_worker(Worker* s, worker_id id, worker_id nbr_count, FILE* events_log, FILE* pipes_log) {
+void init_worker(Worker* s, worker_id id, worker_id nbr_count, Logger* events_log) {
     s->id = id;
     s->nbr_count = nbr_count;
     s->chs = calloc(nbr_count + 1, sizeof(Channel));
+    for (worker_id nbr_id = 0; nbr_id < nbr_count + 1; nbr_id++) s->chs[nbr_id].read_fd = s->chs[nbr_id].write_fd = -1;
     s->events_log = events_log;
+    s->events_bin = NULL;
+    s->epoll_fd = -1;
+    s->transport = TRANSPORT_PIPE;
+    s->topology = TOPOLOGY_MESH;
+    s->listen_fd = -1;
+    s->root_pid = getpid();
+    s->bells = NULL;
+    s->shm = NULL;
+    s->shm_size = 0;
+    s->trace = NULL;
+    s->replay = NULL;
+    s->rx_next = 0;
+    s->rx_priority = 0;
+    s->rx_skips = 0;
 }
 
-void deinit_workers(Worker* s, Worker* workers, FILE* pipes_log) {
+void deinit_workers(Worker* s, Worker* workers, Logger* pipes_log) {
     if (workers != NULL) {
-        for (worker_id nbr_id = 0; nbr_id < s->nbr_count + 1; nbr_id++) {
+        for (worker_id nbr_id = 0; nbr_id < s->nbr_count + 1 && s->transport == TRANSPORT_PIPE; nbr_id++) {
             if (nbr_id == s->id) continue;
+            if (s->chs[nbr_id].read_fd == -1 && s->chs[nbr_id].write_fd == -1) continue;
             close(s->chs[nbr_id].read_fd);
             close(s->chs[nbr_id].write_fd);
-            fprintf(pipes_log, "[deinit_workers] Worker %d closes semi-duplex channel between processes %d and %d (read_fd=%d write_fd=%d)\n", s->id, s->id, nbr_id, s->chs[nbr_id].read_fd, s->chs[nbr_id].write_fd);
-            fflush(pipes_log);
+            logger_printf(pipes_log, "[deinit_workers] Worker %d closes semi-duplex channel between processes %d and %d (read_fd=%d write_fd=%d)\n", s->id, s->id, nbr_id, s->chs[nbr_id].read_fd, s->chs[nbr_id].write_fd);
         }
+        for (worker_id nbr_id = 0; nbr_id < s->nbr_count + 1; nbr_id++) free(s->chs[nbr_id].rx_buf);
+        if (s->epoll_fd != -1) close(s->epoll_fd);
+        if (s->listen_fd != -1) close(s->listen_fd);
+        if (s->shm != NULL) munmap(s->shm, s->shm_size);
         for (worker_id self_id = 0; self_id < s->nbr_count + 1; self_id++) free(workers[self_id].chs);
         free(workers);
     }
 }
 
-int init_workers(Worker* workers, worker_id nbr_count, FILE* events_log, FILE* pipes_log) {
-    for (worker_id self_id = 0; self_id < nbr_count + 1; self_id++) init_worker(&workers[self_id], self_id, nbr_count, events_log, pipes_log);
+int _init_shared_workers(Worker* workers, worker_id nbr_count, Logger* pipes_log) {
+    size_t shm_size = _shm_size(nbr_count);
+    void* shm = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shm == MAP_FAILED) {
+        fprintf(stderr, "Failed to map %zu bytes for shared rings: %s\n", shm_size, strerror(errno));
+        return 1;
+    }
+    Ring* rings = (Ring*)((char*)shm + _shm_bells_size(nbr_count));
+
+    for (worker_id self_id = 0; self_id < nbr_count + 1; self_id++) {
+        workers[self_id].transport = TRANSPORT_SHM;
+        workers[self_id].bells = shm;
+        workers[self_id].shm = shm;
+        workers[self_id].shm_size = shm_size;
+    }
+
+    for (worker_id self_id = 0; self_id < nbr_count + 1; self_id++) {
+        for (worker_id nbr_id = self_id + 1; nbr_id < nbr_count + 1; nbr_id++) {
+            init_shared_duplex_channel(&workers[self_id].chs[nbr_id], &workers[nbr_id].chs[self_id], rings);
+            logger_printf(pipes_log, "[init_workers] Map duplex ring channel between processes %d and %d\n", self_id, nbr_id);
+            rings += 2;
+        }
+    }
+    return 0;
+}
+
+int _init_listeners(Worker* workers, worker_id nbr_count, Logger* pipes_log) {
+    for (worker_id self_id = PARENT_ID + 1; self_id < nbr_count + 1; self_id++) {
+        Worker* s = &workers[self_id];
+        s->listen_fd = unixsock_listen(s->root_pid, self_id);
+        if (s->listen_fd == -1) {
+            fprintf(stderr, "Failed to set up a listener for worker %d: %s\n", self_id, strerror(errno));
+            return 1;
+        }
+        logger_printf(pipes_log, "[init_workers] Worker %d listens for its siblings on listen_fd=%d\n", self_id, s->listen_fd);
+    }
+    return 0;
+}
+
+int connect_lazy_channel(Worker* s, worker_id dst) {
+    int fd = unixsock_connect(s->root_pid, dst, s->id);
+    if (fd == -1) return -1;
+    s->chs[dst].write_fd = fd;
+    return 0;
+}
+
+int accept_lazy_channels(Worker* s) {
+    while (1) {
+        worker_id src;
+        int fd = unixsock_accept(s->listen_fd, &src);
+        if (fd == -1) return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+
+        if (src <= PARENT_ID || src > s->nbr_count || src == s->id || s->chs[src].read_fd != -1) {
+            close(fd);
+            errno = EPROTO;
+            return -1;
+        }
+        struct epoll_event event = { .events = EPOLLIN, .data = { .u32 = src } };
+        if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            close(fd);
+            return -1;
+        }
+        s->chs[src].read_fd = fd;
+    }
+}
+
+int init_workers(Worker* workers, worker_id nbr_count, Transport transport, Topology topology, Logger* events_log, Logger* pipes_log) {
+    for (worker_id self_id = 0; self_id < nbr_count + 1; self_id++) init_worker(&workers[self_id], self_id, nbr_count, events_log);
+
+    if (transport == TRANSPORT_SHM) return _init_shared_workers(workers, nbr_count, pipes_log);
+
+    for (worker_id self_id = 0; self_id < nbr_count + 1; self_id++) workers[self_id].topology = topology;
+    if (topology == TOPOLOGY_LAZY && _init_listeners(workers, nbr_count, pipes_log) != 0) return 1;
 
     for (worker_id self_id = 0; self_id < nbr_count + 1; self_id++) {
+        // children only start with their channel to the parent
+        if (topology == TOPOLOGY_LAZY && self_id != PARENT_ID) break;
         for (worker_id nbr_id = self_id + 1; nbr_id < nbr_count + 1; nbr_id++) {
             if (init_duplex_channel(&workers[self_id].chs[nbr_id], &workers[nbr_id].chs[self_id], pipes_log) != 0) {
                 fprintf(stderr, "Failed to initialize a duplex channel between [%d] and [%d]: %s\n", self_id, nbr_id, strerror(errno));
                 return 1;
             }
-            fprintf(pipes_log, "[init_workers] Open duplex channel between processes %d and %d\n", self_id, nbr_id);
-            fprintf(pipes_log, "[init_workers] Worker %d read_fd=%d write_fd=%d\n", self_id, workers[self_id].chs[nbr_id].read_fd, workers[self_id].chs[nbr_id].write_fd);
-            fprintf(pipes_log, "[init_workers] Worker %d read_fd=%d write_fd=%d\n", nbr_id, workers[nbr_id].chs[self_id].read_fd, workers[nbr_id].chs[self_id].write_fd);
-            fflush(pipes_log);
+            logger_printf(pipes_log, "[init_workers] Open duplex channel between processes %d and %d\n", self_id, nbr_id);
+            logger_printf(pipes_log, "[init_workers] Worker %d read_fd=%d write_fd=%d\n", self_id, workers[self_id].chs[nbr_id].read_fd, workers[self_id].chs[nbr_id].write_fd);
+            logger_printf(pipes_log, "[init_workers] Worker %d read_fd=%d write_fd=%d\n", nbr_id, workers[nbr_id].chs[self_id].read_fd, workers[nbr_id].chs[self_id].write_fd);
         }
     }
     return 0;
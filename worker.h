@@ -1,32 +1,123 @@
 #ifndef __IFMO_DISTRIBUTED_CLASS_WORKER__H
 #define __IFMO_DISTRIBUTED_CLASS_WORKER__H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/types.h>
+
+#include "eventlog.h"
+#include "ipc.h"
+#include "lamport.h"
+#include "logger.h"
+#include "ring.h"
+#include "trace.h"
 
 typedef int8_t worker_id;
 
+typedef enum {
+    TRANSPORT_PIPE = 0, // a pair of non-blocking pipes per process pair
+    TRANSPORT_SHM,      // a pair of SPSC rings per process pair, mapped before fork()
+} Transport;
+
+typedef enum {
+    TOPOLOGY_MESH = 0, // every channel is opened before fork()
+    TOPOLOGY_LAZY,     // only parent<->child channels are opened before fork(), children connect to each other on first send
+} Topology;
+
+enum {
+    CHANNEL_RX_BUFFER_LEN = 1 << 16, ///< drains a full default pipe buffer in one read()
+    LISTEN_EPOLL_ID = MAX_PROCESS_ID + 1, ///< epoll data of Worker.listen_fd, channels use the peer id
+    MAX_FRAME_LEN = MAX_MESSAGE_LEN + sizeof(uint16_t), ///< a message followed by the upper half of a wide Lamport time
+    RX_PRIORITY_MAX_SKIPS = 4 ///< receives in a row a priority frame may take the turn of another peer
+};
+
 typedef struct {
     int read_fd;
     int write_fd;
+    char* rx_buf; // TRANSPORT_PIPE: bytes read ahead from read_fd, allocated on first use by the reading process
+    size_t rx_head; // start of the first unconsumed frame in rx_buf
+    size_t rx_tail; // end of the bytes read so far
+    Ring* rx; // TRANSPORT_SHM only
+    Ring* tx; // TRANSPORT_SHM only
 } Channel;
 
 typedef struct {
     worker_id id;
     Channel* chs;
     worker_id nbr_count;
-    FILE* events_log;
+    Logger* events_log;
+    BinaryEventLog* events_bin; // replaces events_log for event lines when set
+    int epoll_fd; // readiness set over chs[*].read_fd, owned by the process running this worker
+    worker_id last_src; // sender of the last message handed out by receive/receive_any
+    lamport_time_t last_time; // s_local_time of that message, with the sender's upper 16 bits when wide_clock is set
+    bool wide_clock; // every frame carries the upper half of the sender's Lamport time after its header
+    Transport transport;
+    Topology topology;
+    int listen_fd; // TOPOLOGY_LAZY: children accept links from their siblings here, -1 otherwise
+    pid_t root_pid; // TOPOLOGY_LAZY: parent pid, part of the listener names so concurrent runs do not meet
+    Doorbell* bells; // TRANSPORT_SHM: one per worker, rung whenever one of its rx rings gets a frame
+    bool busy_poll; // TRANSPORT_SHM: waits spin on the doorbells instead of sleeping in the kernel
+    void* shm; // TRANSPORT_SHM: mapping holding the bells and all rings
+    size_t shm_size;
+    TraceWriter* trace; // --record-trace: every message sent or received is appended here
+    TraceReader* replay; // --replay-trace: messages come out of a recorded trace and sends are checked against it, no channel is used
+    worker_id rx_next; // peer whose turn it is in receive_any, so a busy low id cannot keep the others waiting
+    uint32_t rx_priority; // --rx-priority: bit per MessageType served ahead of its turn
+    int rx_skips; // receives in a row that served a priority frame instead of the peer whose turn it was
 } Worker;
 
-int init_duplex_channel(Channel* ch_0, Channel* ch_1, FILE* pipes_log);
+/** Sends a message given as a header and a separate payload of header->s_payload_len bytes,
+ *  so callers do not have to assemble a full Message.
+ */
+int send_iov(void* self, local_id dst, const MessageHeader* header, const void* payload);
+
+int send_multicast_iov(void* self, const MessageHeader* header, const void* payload);
+
+/** Waits for a message from any process and returns only its header, the payload stays queued
+ *  until receive_payload(). The sender is available in Worker.last_src.
+ *  Peers with frames waiting are served in turns, a frame of a Worker.rx_priority type may go
+ *  ahead of the turn at most RX_PRIORITY_MAX_SKIPS times in a row.
+ */
+int receive_any_header(void* self, MessageHeader* header);
+
+/** Copies the payload of the message announced by receive_any_header() to payload and drops the message.
+ *  A NULL payload just drops it.
+ */
+void receive_payload(void* self, void* payload);
+
+/** Connects to dst's listener and sends our id, so dst knows which channel the stream belongs to.
+ *  The connection only carries frames towards dst, dst opens its own when it first sends to us.
+ */
+int connect_lazy_channel(Worker* s, worker_id dst);
+
+/** Accepts every pending connection on Worker.listen_fd and starts watching it */
+int accept_lazy_channels(Worker* s);
+
+int init_duplex_channel(Channel* ch_0, Channel* ch_1, Logger* pipes_log);
+
+void init_shared_duplex_channel(Channel* ch_0, Channel* ch_1, Ring* rings);
+
+int deinit_unused_channels(Worker* s, Worker* workers, Logger* pipes_log);
+
+/** Same as deinit_unused_channels(), but closes runs of adjacent descriptors with one close_range()
+ *  and logs one line per run instead of one per channel.
+ */
+int deinit_unused_channels_bulk(Worker* s, Worker* workers, Logger* pipes_log);
 
-void deinit_unused_channels(Worker* s, Worker* workers, FILE* pipes_log);
+/** Forks one process per worker in [first, last] as a tree: every child forks part of the range
+ *  on its own with CLONE_PARENT, so all of them are children of the caller, yet the caller only
+ *  waits for about log2(N) fork() calls.
+ *
+ * @return id of the worker the calling process runs, PARENT_ID in the caller, -1 if a fork failed
+ */
+worker_id spawn_workers_tree(worker_id first, worker_id last);
 
-void init_worker(Worker* s, worker_id id, worker_id nbr_count, FILE* events_log, FILE* pipes_log);
+void init_worker(Worker* s, worker_id id, worker_id nbr_count, Logger* events_log);
 
-int init_workers(Worker* workers, worker_id nbr_count, FILE* events_log, FILE* pipes_log);
+int init_workers(Worker* workers, worker_id nbr_count, Transport transport, Topology topology, Logger* events_log, Logger* pipes_log);
 
-void deinit_workers(Worker* s, Worker* workers, FILE* pipes_log);
+void deinit_workers(Worker* s, Worker* workers, Logger* pipes_log);
 
 #endif // __IFMO_DISTRIBUTED_CLASS_WORKER__H